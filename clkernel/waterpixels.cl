@@ -71,6 +71,19 @@ constant float3 xyzToRGB_row1 = (float3)(1.876f, -0.533f, -0.343f);
 constant float3 xyzToRGB_row2 = (float3)(-0.967f, 1.998f, -0.031f);
 constant float3 xyzToRGB_row3 = (float3)(0.057f, -0.118f, 1.061f);
 
+// ########## SPECIALIZATION ##########
+// ####################################
+
+// programs built for one image size and structuring element radius get them as constants,
+// so the morphology loops are unrolled and the bounds checks of inner pixels disappear
+#ifdef WIDTH
+#define MORPHOLOGY_WIDTH WIDTH
+#define MORPHOLOGY_HEIGHT HEIGHT
+#else
+#define MORPHOLOGY_WIDTH width
+#define MORPHOLOGY_HEIGHT height
+#endif
+
 // ########## PROTOTYPES ##########
 // ################################
 
@@ -78,33 +91,24 @@ labColor rgbToLab(rgbColor color);
 
 rgbColor labToRgb(labColor color);
 
-Gradient computeGradient(const int x, const int y, int index, const int width, const int height, global const unsigned char* src);
-
-int validSeed(const int startIndex, const int endIndex, const int seedIndex, const global int* indices);
+rgbColor neighbourColor(const int x, const int y, const int dx, const int dy, const int width, const int height, global const unsigned char* src);
 
-int growRegion(
-		const int width,
-		const int rootIndex,
-		const int startIndex,
-		const int endIndex,
-		const global int* indices,
-		const global unsigned char* gradient,
-		const int minGradient,
-		global bool* indexVisited);
-
-void colorMaxRegion(
-		const int width,
-		const int rootIndex,
-		const int startIndex,
-		const int endIndex,
-		const global int* indices,
-		const global unsigned char* gradient,
-		const int minGradient,
-		global bool* indexVisited,
-		global unsigned char* markers);
+Gradient computeGradient(const int x, const int y, const int width, const int height, global const unsigned char* src);
 
 bool validIndex(int index, int width, int height);
 
+size_t batchPixels(const int width, const int height, const uint dimension);
+
+bool outsideImage(const int width, const int height);
+
+int morphologyRadius(const int gStep, const int fixedSize);
+
+bool innerPixel(const size_t id, const int radius, const int width, const int height);
+
+float labGradient(const int width, const int height, global const unsigned char* src);
+
+float markersDistance(const int width, const int height, const float gridStep, global const int* markersIndices, global const int* markersOffsets);
+
 // ########## WATERPIXELS FUNCTIONS ##########
 // ###########################################
 
@@ -113,6 +117,42 @@ bool validIndex(int index, int width, int height)
 	return index > 0 && index < (width * height * 3);
 }
 
+/**
+ *	pixels before the current image, batched launches stack images of the same size along the given dimension
+ *	of the NDRange, whose extent is 1 for single images
+ */
+size_t batchPixels(const int width, const int height, const uint dimension)
+{
+	return get_global_id(dimension) * (size_t)(width) * (size_t)(height);
+}
+
+/**
+ *	2D kernels are launched on whole work-groups, the work-items of the padding have nothing to do
+ */
+bool outsideImage(const int width, const int height)
+{
+	return get_global_id(0) >= (size_t)(width) || get_global_id(1) >= (size_t)(height);
+}
+
+int morphologyRadius(const int gStep, const int fixedSize)
+{
+#ifdef RADIUS
+	// specialized programs are only built for the radius of the grid step
+	return RADIUS;
+#else
+	const int size = (fixedSize == 1) ? 2 : max(2, gStep / 16);
+	return size / 2;
+#endif
+}
+
+/**
+ *	true when every pixel of the cross of the morphology around id passes validIndex
+ */
+bool innerPixel(const size_t id, const int radius, const int width, const int height)
+{
+	return id > (size_t)(radius * width) && id + radius * width <= (size_t)(width * height);
+}
+
 kernel void computeErode(
 		const int gStep,
 		const int width,
@@ -121,9 +161,13 @@ kernel void computeErode(
 		global unsigned char* res,
 		int fixedSize)
 {
-	size_t id = get_global_id(0);
-	const int size = (fixedSize == 1) ? 2 : max(2, gStep / 16);
-	int radius = size / 2;
+	if(outsideImage(MORPHOLOGY_WIDTH, MORPHOLOGY_HEIGHT))
+		return;
+	size_t id = get_global_id(1) * MORPHOLOGY_WIDTH + get_global_id(0);
+	img += batchPixels(MORPHOLOGY_WIDTH, MORPHOLOGY_HEIGHT, 2) * 3;
+	res += batchPixels(MORPHOLOGY_WIDTH, MORPHOLOGY_HEIGHT, 2) * 3;
+	const int radius = morphologyRadius(gStep, fixedSize);
+	const bool inner = innerPixel(id, radius, MORPHOLOGY_WIDTH, MORPHOLOGY_HEIGHT);
 	int baseIndex = id*3;
 	int index;
 
@@ -138,8 +182,8 @@ kernel void computeErode(
 		{
 			if(l != 0 && c != 0)
 				continue;
-			index = baseIndex + (l * width * 3) + (c * 3);
-			if(validIndex(index, width, height))
+			index = baseIndex + (l * MORPHOLOGY_WIDTH * 3) + (c * 3);
+			if(inner || validIndex(index, MORPHOLOGY_WIDTH, MORPHOLOGY_HEIGHT))
 			{
 				if(img[index] < red)
 					red = img[index];
@@ -163,9 +207,13 @@ kernel void computeDilation(
 		global unsigned char* res,
 		int fixedSize)
 {
-	size_t id = get_global_id(0);
-	const int size = (fixedSize == 1) ? 2 : max(2, gStep / 16);
-	int radius = size / 2;
+	if(outsideImage(MORPHOLOGY_WIDTH, MORPHOLOGY_HEIGHT))
+		return;
+	size_t id = get_global_id(1) * MORPHOLOGY_WIDTH + get_global_id(0);
+	img += batchPixels(MORPHOLOGY_WIDTH, MORPHOLOGY_HEIGHT, 2) * 3;
+	res += batchPixels(MORPHOLOGY_WIDTH, MORPHOLOGY_HEIGHT, 2) * 3;
+	const int radius = morphologyRadius(gStep, fixedSize);
+	const bool inner = innerPixel(id, radius, MORPHOLOGY_WIDTH, MORPHOLOGY_HEIGHT);
 	int baseIndex = id*3;
 	int index;
 
@@ -180,8 +228,8 @@ kernel void computeDilation(
 		{
 			if(l != 0 && c != 0)
 				continue;
-			index = baseIndex + (l * width * 3) + (c * 3);
-			if(validIndex(index, width, height))
+			index = baseIndex + (l * MORPHOLOGY_WIDTH * 3) + (c * 3);
+			if(inner || validIndex(index, MORPHOLOGY_WIDTH, MORPHOLOGY_HEIGHT))
 			{
 				if(img[index] > red)
 					red = img[index];
@@ -197,374 +245,597 @@ kernel void computeDilation(
 	res[baseIndex+2] = blue;
 }
 
-kernel void computeOutline(
-		const int gStep,
-		const int width,
-		const int height,
-		global const unsigned char* img,
-		global unsigned char* res)
+/**
+ *	distance of the current pixel to its nearest marker, in half grid steps,
+ *	markers of image i are markersIndices[markersOffsets[i]] to markersIndices[markersOffsets[i+1] - 1]
+ */
+float markersDistance(const int width, const int height, const float gridStep, global const int* markersIndices, global const int* markersOffsets)
 {
-	size_t id = get_global_id(0);
-	const int size = 4;
-	int radius = size / 2;
-	int baseIndex = id*3;
-	int index;
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	const size_t image = get_global_id(2);
 
-	int red = 0;
-	int green = 0;
-	int blue = 0;
+	float dist = FLT_MAX;
 
-	// dilate
-	for(int l = -radius; l < radius; ++l)
-	{
-		for(int c = -radius; c < radius; ++c)
-		{
-			index = baseIndex + (l * width * 3) + (c * 3);
-			if(validIndex(index, width, height))
-			{
-				if(img[index] > red)
-					red = img[index];
-				if(img[index+1] > green)
-					green = img[index+1];
-				if(img[index+2] > blue)
-					blue = img[index+2];
-			}
-		}
-	}
-	if(red == 255 && green == 255 && blue == 255)
+	for(int i = markersOffsets[image]; i < markersOffsets[image+1]; ++i)
 	{
-		res[baseIndex] = 10;
-		res[baseIndex+1] = 10;
-		res[baseIndex+2] = 10;
+		int index = markersIndices[i];
+		int markerX = index % width;
+		int markerY = (index / width) % height;
+
+		int deltaX = markerX - x;
+		int deltaY = markerY - y;
+
+		dist = min(dist, sqrt( (float)(deltaX * deltaX) + (float)(deltaY * deltaY) ));
 	}
+
+	return dist * (2.0f/gridStep);
 }
 
-kernel void computeMarkers(
+/**
+ *	magnitude of the Lab gradient of the current pixel
+ */
+float labGradient(const int width, const int height, global const unsigned char* src)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+
+	Gradient grad = computeGradient(x, y, width, height, src);
+	return sqrt((float)(grad.gx * grad.gx) + (float)(grad.gy * grad.gy));
+}
+
+kernel void computeLabGradient(const int width, const int height, global const unsigned char* src, global unsigned char* dest)
+{
+	if(outsideImage(width, height))
+		return;
+	size_t id = get_global_id(1) * width + get_global_id(0);
+	src += batchPixels(width, height, 2) * 3;
+	dest += batchPixels(width, height, 2) * 3;
+
+	int g = (int)(labGradient(width, height, src));
+
+	dest[id*3] = g;
+	dest[id*3+1] = g;
+	dest[id*3+2] = g;
+}
+
+/**
+ *	same as computeLabGradient, also written to precise as 8.8 fixed point
+ */
+kernel void computePreciseLabGradient(
+		const int width,
+		const int height,
+		global const unsigned char* src,
+		global unsigned char* dest,
+		global ushort* precise)
+{
+	if(outsideImage(width, height))
+		return;
+	size_t id = get_global_id(1) * width + get_global_id(0);
+	src += batchPixels(width, height, 2) * 3;
+	dest += batchPixels(width, height, 2) * 3;
+	precise += batchPixels(width, height, 2);
+
+	float gradient = labGradient(width, height, src);
+	int g = (int)(gradient);
+
+	dest[id*3] = g;
+	dest[id*3+1] = g;
+	dest[id*3+2] = g;
+	precise[id] = (ushort)(min(65535.0f, gradient * 256.0f));
+}
+
+/**
+ *	spatial regularization of the gradient in one pass : gradient + weight * distance to the nearest marker,
+ *	distance gets the weighted distance for display
+ */
+kernel void computeRegularizedGradient(
 		const int width,
-		global const int* indices,
-		global const int* indicesCount,
-		global bool* indexVisited,
+		const int height,
+		const float gridStep,
+		const float weight,
+		global const int* markersIndices,
+		global const int* markersOffsets,
 		global const unsigned char* gradient,
-		global unsigned char* markers)
+		global unsigned char* distance,
+		global unsigned char* dest)
+{
+	if(outsideImage(width, height))
+		return;
+	size_t id = get_global_id(1) * width + get_global_id(0);
+	int baseIndex = id*3;
+	gradient += batchPixels(width, height, 2) * 3;
+	distance += batchPixels(width, height, 2) * 3;
+	dest += batchPixels(width, height, 2) * 3;
+
+	const float dist = min(255.0f, weight * markersDistance(width, height, gridStep, markersIndices, markersOffsets));
+	const int res = (int)(dist);
+	const int level = min(255, gradient[baseIndex] + res);
+
+	distance[baseIndex] = res;
+	distance[baseIndex+1] = res;
+	distance[baseIndex+2] = res;
+	dest[baseIndex] = level;
+	dest[baseIndex+1] = level;
+	dest[baseIndex+2] = level;
+}
+
+/**
+ *	same as computeRegularizedGradient on a 8.8 fixed point gradient, the 16 bits levels are written to precise,
+ *	dest gets their integer part for display
+ */
+kernel void computePreciseRegularizedGradient(
+		const int width,
+		const int height,
+		const float gridStep,
+		const float weight,
+		global const int* markersIndices,
+		global const int* markersOffsets,
+		global const ushort* gradient,
+		global unsigned char* distance,
+		global unsigned char* dest,
+		global ushort* precise)
+{
+	if(outsideImage(width, height))
+		return;
+	size_t id = get_global_id(1) * width + get_global_id(0);
+	int baseIndex = id*3;
+	gradient += batchPixels(width, height, 2);
+	distance += batchPixels(width, height, 2) * 3;
+	dest += batchPixels(width, height, 2) * 3;
+	precise += batchPixels(width, height, 2);
+
+	const float dist = weight * markersDistance(width, height, gridStep, markersIndices, markersOffsets);
+	const int res = (int)(min(255.0f, dist));
+	const uint level = min(65535u, (uint)(gradient[id]) + (uint)(min(65535.0f, dist * 256.0f)));
+
+	distance[baseIndex] = res;
+	distance[baseIndex+1] = res;
+	distance[baseIndex+2] = res;
+	precise[id] = level;
+	dest[baseIndex] = level >> 8;
+	dest[baseIndex+1] = level >> 8;
+	dest[baseIndex+2] = level >> 8;
+}
+
+// ########## WATERSHED ##########
+// ###############################
+
+/**
+ *	flooding keys are ordered so that the smallest one wins :
+ *	highest level met on the path (16 bits), pixels walked since that level was reached (16 bits), label (32 bits)
+ *	unreached pixels hold ULONG_MAX
+ */
+#define KEY_LEVEL(key) ((key) >> 48)
+#define KEY_STEPS(key) (((key) >> 32) & 0xFFFF)
+#define KEY_LABEL(key) ((key) & 0xFFFFFFFF)
+
+/**
+ *	neighbour offsets, the 4 first ones are the 4-neighbourhood
+ */
+constant int2 neighbourhood[8] = {(int2)(-1, 0), (int2)(0, -1), (int2)(1, 0), (int2)(0, 1), (int2)(-1, -1), (int2)(1, -1), (int2)(1, 1), (int2)(-1, 1)};
+
+/**
+ *	seeds are (pixel, label) pairs, flood must be filled with ULONG_MAX before the launch
+ */
+kernel void seedWatershed(global const int2* seeds, global ulong* flood)
 {
 	size_t id = get_global_id(0);
+	int2 seed = seeds[id];
 
-	int offset = 0;
-	for(int i = 0; i < id; ++i)
-	{
-		offset = offset + indicesCount[i];
-	}
+	flood[seed.x] = (ulong)(seed.y);
+}
+
+/**
+ *	smallest key the current pixel of the given level can take from its neighbours
+ */
+ulong relaxWatershed(const int width, const int height, const ulong level, global const ulong* src, const int connectivity)
+{
+	size_t id = get_global_id(0);
+	int x = id % width;
+	int y = id / width;
+
+	ulong best = src[id];
 
-	// compute min gradient in cell
-	int minGradient = 255;
-	int pixel;
-	int pixelCount = indicesCount[id];
-	for(int i = offset; i < (offset + pixelCount); ++i)
+	for(int i = 0; i < connectivity; ++i)
 	{
-		pixel = indices[i];
-		if(gradient[pixel] < minGradient)
-			minGradient = gradient[pixel];
+		const int2 offset = neighbourhood[i];
+		if(x + offset.x < 0 || x + offset.x >= width || y + offset.y < 0 || y + offset.y >= height)
+			continue;
+
+		ulong neighbour = src[id + offset.y * width + offset.x];
+		if(neighbour == ULONG_MAX)
+			continue;
+
+		// climbing resets the walk, a plateau is shared by distance to where it was entered
+		ulong candidate;
+		if(level > KEY_LEVEL(neighbour))
+			candidate = (level << 48) | KEY_LABEL(neighbour);
+		else
+			candidate = (neighbour & 0xFFFF0000FFFFFFFFUL) | ((ulong)(min(KEY_STEPS(neighbour) + 1, (ulong)0xFFFF)) << 32);
+		best = min(best, candidate);
 	}
+	return best;
+}
 
-	// get seed giving the max area
-	int maxSeed = -1;
-	int maxArea = -1;
-	int area;
-	float coverage;
-	int seedIndex;
-	for(int i = offset; i < offset + pixelCount; ++i)
-		indexVisited[i] = false;
+/**
+ *	one relaxation step of the minimax flooding, src and dest are swapped between launches
+ *	changed is set to 1 as soon as one key decreases
+ */
+kernel void propagateWatershed(
+		const int width,
+		const int height,
+		global const unsigned char* regularizedGradient,
+		global const ulong* src,
+		global ulong* dest,
+		global int* changed,
+		const int connectivity)
+{
+	size_t id = get_global_id(0);
+
+	const ulong best = relaxWatershed(width, height, regularizedGradient[id*3], src, connectivity);
+	dest[id] = best;
+	if(best != src[id])
+		*changed = 1;
+}
+
+/**
+ *	same as propagateWatershed on a planar 16 bits regularized gradient
+ */
+kernel void propagatePreciseWatershed(
+		const int width,
+		const int height,
+		global const ushort* regularizedGradient,
+		global const ulong* src,
+		global ulong* dest,
+		global int* changed,
+		const int connectivity)
+{
+	size_t id = get_global_id(0);
 
-	for(int i = offset; i < (offset + pixelCount); ++i)
+	const ulong best = relaxWatershed(width, height, regularizedGradient[id], src, connectivity);
+	dest[id] = best;
+	if(best != src[id])
+		*changed = 1;
+}
+
+/**
+ *	pixels touching a basin of higher label become the watershed line (label 0),
+ *	so lines are one pixel thick and still separate basins in the flooding connectivity
+ */
+kernel void computeWatershedLabels(
+		const int width,
+		const int height,
+		global const ulong* flood,
+		global int* labels,
+		const int connectivity)
+{
+	size_t id = get_global_id(0);
+	int x = id % width;
+	int y = id / width;
+
+	const ulong key = flood[id];
+	int label = (key == ULONG_MAX) ? 0 : (int)(KEY_LABEL(key));
+
+	for(int i = 0; i < connectivity && label != 0; ++i)
 	{
-		seedIndex = indices[i];
-		if(gradient[seedIndex] == minGradient && !indexVisited[i - offset])
-		{
-			area = growRegion(width, seedIndex, offset, offset + pixelCount, indices, gradient, minGradient, indexVisited);
-			coverage = (float)(area) / (float)(pixelCount);
-			if(area > maxArea)
-			{
-				maxArea = area;
-				maxSeed = seedIndex;
-				if(coverage >= 0.5f)
-					break;
-			}
-		}
-	}
+		const int2 offset = neighbourhood[i];
+		if(x + offset.x < 0 || x + offset.x >= width || y + offset.y < 0 || y + offset.y >= height)
+			continue;
 
-	for(int i = offset; i < offset + pixelCount; ++i)
-		indexVisited[i] = false;
+		ulong neighbour = flood[id + offset.y * width + offset.x];
+		if(neighbour != ULONG_MAX && (int)(KEY_LABEL(neighbour)) > label)
+			label = 0;
+	}
 
-	// color markers with highest surface extinction
-	colorMaxRegion(width, maxSeed, offset, offset + pixelCount, indices, gradient, minGradient, indexVisited, markers);
+	labels[id] = label;
 }
 
-int validSeed(const int startIndex, const int endIndex, const int seedIndex, const global int* indices)
+// ########## MARKERS ##########
+// #############################
+
+#ifndef MARKERS_GROUP_SIZE
+#define MARKERS_GROUP_SIZE 64
+#endif
+
+/**
+ *	root of a pixel in a union-find forest, with path halving
+ */
+int findRoot(global int* parent, int i)
 {
-	int node;
-	for(int i = startIndex; i < endIndex; ++i)
+	while(parent[i] != i)
 	{
-		if(seedIndex == indices[i])
-			return i;
+		parent[i] = parent[parent[i]];
+		i = parent[i];
 	}
-	return -1;
+	return i;
+}
+
+/**
+ *	index in the cell of the neighbour of pixel at offset, -1 when it is not a core pixel of the cell
+ */
+int cellNeighbour(const int width, const int height, const int pixel, const int2 offset, const int count, global const int* pixels, global const int* positions)
+{
+	const int x = pixel % width;
+	const int y = pixel / width;
+	if(x + offset.x < 0 || x + offset.x >= width || y + offset.y < 0 || y + offset.y >= height)
+		return -1;
+
+	// positions of pixels outside the cell are stale or written by other work-groups
+	const int n = pixel + offset.y * width + offset.x;
+	const int q = positions[n];
+	if(q < 0 || q >= count || pixels[q] != 3 * n)
+		return -1;
+	return q;
 }
 
-int growRegion(
+/**
+ *	one work-group per cell, the core pixels of cell c are pixels[offsets[c]] to pixels[offsets[c+1] - 1], as RGB indices.
+ *	The minimum of highest area extinction is found by the union-find of computeCellMarker on the host,
+ *	run by the first work-item over the pixels sorted by the group, so both select the same marker;
+ *	its plateau is then grown by the whole group. That serial tree makes it a fallback to the host selection,
+ *	used on request by Engine::setDeviceMarkers.
+ *	tree holds 5 ints per core pixel, markers must be filled with 0 before the launch,
+ *	seeds receives the RGB index of the first marker pixel of each cell in raster order, -1 for an empty cell
+ */
+kernel __attribute__((reqd_work_group_size(MARKERS_GROUP_SIZE, 1, 1)))
+void computeCellMarkers(
 		const int width,
-		const int rootIndex,
-		const int startIndex,
-		const int endIndex,
-		global const int* indices,
+		const int height,
+		global const int* pixels,
+		global const int* offsets,
+		global int* positions,
+		global int* tree,
 		global const unsigned char* gradient,
-		const int minGradient,
-		global bool* indexVisited)
+		global unsigned char* markers,
+		global int* seeds,
+		const int connectivity)
 {
-	// array of seeds
-	int seedIndex[262144];
-	seedIndex[0] = rootIndex;
-	int seeds = 1;
-
-	int node;
-	int N; int S; int E; int W;
-	int NE; int NW; int SE; int SW;
-
-	int area = 0;
-	int offset = 0;
+	const int cell = get_group_id(0);
+	const int lid = get_local_id(0);
+	const int offset = offsets[cell];
+	const int count = offsets[cell + 1] - offset;
+	pixels += offset;
+	global int* order = tree + 5 * offset;
+	global int* parent = order + count;
+	global int* area = parent + count;
+	global int* minimum = area + count;
+	global int* extinction = minimum + count;
+
+	local int histogram[257];
+	local int best;
+	local int changed;
+	local int first;
+
+	// positions and histogram of the levels, in parallel
+	for(int i = lid; i < 257; i += MARKERS_GROUP_SIZE)
+		histogram[i] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for(int i = lid; i < count; i += MARKERS_GROUP_SIZE)
+	{
+		positions[pixels[i] / 3] = i;
+		parent[i] = -1;
+		extinction[i] = 0;
+		atomic_inc(&histogram[gradient[pixels[i]] + 1]);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
 
-	while(seeds > 0)
+	// the component tree is built in the order of the host, pixels of a level in cell order
+	if(lid == 0)
 	{
-		for(int i = 0; i < seeds; ++i)
+		for(int l = 1; l < 257; ++l)
+			histogram[l] += histogram[l-1];
+		for(int i = 0; i < count; ++i)
+			order[histogram[gradient[pixels[i]]]++] = i;
+
+		for(int k = 0; k < count; ++k)
 		{
-			int index = seedIndex[i];
-			node = validSeed(startIndex, endIndex, index, indices);
-			if(node != -1 && gradient[index] == minGradient)
+			const int p = order[k];
+			const int level = gradient[pixels[p]];
+			parent[p] = p;
+			area[p] = 1;
+			minimum[p] = p;
+
+			for(int i = 0; i < connectivity; ++i)
 			{
-				// surface increase
-				area++;
-
-				// mark seed as visited
-				indexVisited[node] = true;
-
-				// get surrounding nodes
-				N = index - (width*3);
-				S = index + (width*3);
-				E = index + 3;
-				W = index - 3;
-				NE = index - (width*3) + 3;
-				NW = index - (width*3) - 3;
-				SE = index + (width*3) + 3;
-				SW = index + (width*3) - 3;
-
-				// rewrite seedIndex array
-				node = validSeed(startIndex, endIndex, N, indices);
-				if(node != -1 && !indexVisited[node])
-				{
-					seedIndex[offset] = N;
-					offset = offset + 1;
-				}
-				node = validSeed(startIndex, endIndex, S, indices);
-				if(node != -1 && !indexVisited[node])
-				{
-					seedIndex[offset] = S;
-					offset = offset + 1;
-				}
-				node = validSeed(startIndex, endIndex, E, indices);
-				if(node != -1 && !indexVisited[node])
-				{
-					seedIndex[offset] = E;
-					offset = offset + 1;
-				}
-				node = validSeed(startIndex, endIndex, W, indices);
-				if(node != -1 && !indexVisited[node])
-				{
-					seedIndex[offset] = W;
-					offset = offset + 1;
-				}
-				node = validSeed(startIndex, endIndex, NE, indices);
-				if(node != -1 && !indexVisited[node])
-				{
-					seedIndex[offset] = NE;
-					offset = offset + 1;
-				}
-				node = validSeed(startIndex, endIndex, NW, indices);
-				if(node != -1 && !indexVisited[node])
-				{
-					seedIndex[offset] = NW;
-					offset = offset + 1;
-				}
-				node = validSeed(startIndex, endIndex, SE, indices);
-				if(node != -1 && !indexVisited[node])
-				{
-					seedIndex[offset] = SE;
-					offset = offset + 1;
-				}
-				node = validSeed(startIndex, endIndex, SW, indices);
-				if(node != -1 && !indexVisited[node])
+				const int q = cellNeighbour(width, height, pixels[p] / 3, neighbourhood[i], count, pixels, positions);
+				if(q == -1 || parent[q] == -1)
+					continue;
+
+				int a = findRoot(parent, p);
+				int b = findRoot(parent, q);
+				if(a == b)
+					continue;
+
+				// keep the larger component as root
+				if(area[a] < area[b] || (area[a] == area[b] && minimum[a] > minimum[b]))
 				{
-					seedIndex[offset] = SW;
-					offset = offset + 1;
+					const int swap = a;
+					a = b;
+					b = swap;
 				}
+
+				// two minima meet, the smaller one dies with its area as extinction value
+				const bool minimumA = gradient[pixels[minimum[a]]] < level;
+				const bool minimumB = gradient[pixels[minimum[b]]] < level;
+				if(minimumA && minimumB)
+					extinction[minimum[b]] = area[b];
+				else if(minimumB)
+					minimum[a] = minimum[b];
+
+				parent[b] = a;
+				area[a] += area[b];
 			}
 		}
-		seeds = offset;
-		offset = 0;
-	}
 
-	return area;
-}
-
-void colorMaxRegion(
-		const int width,
-		const int rootIndex,
-		const int startIndex,
-		const int endIndex,
-		global const int* indices,
-		global const unsigned char* gradient,
-		const int minGradient,
-		global bool* indexVisited,
-		global unsigned char* markers)
-{
-	// array of seeds
-	int seedIndex[262144];
-	seedIndex[0] = rootIndex;
-	int seeds = 1;
+		// surviving minima take the area of their whole component
+		for(int i = 0; i < count; ++i)
+		{
+			if(parent[i] == i)
+				extinction[minimum[i]] = area[i];
+		}
 
-	int node;
-	int N; int S; int E; int W;
-	int NE; int NW; int SE; int SW;
+		best = -1;
+		for(int i = 0; i < count; ++i)
+		{
+			if(extinction[i] > 0 && (best == -1 || extinction[i] > extinction[best]))
+				best = i;
+		}
+		first = INT_MAX;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
 
-	int offset = 0;
+	if(best == -1)
+	{
+		if(lid == 0)
+			seeds[cell] = -1;
+		return;
+	}
 
-	while(seeds > 0)
+	// the plateau of the minimum grows over its neighbours of the same level, order is free by now
+	const unsigned char level = gradient[pixels[best]];
+	global int* plateau = order;
+	for(int i = lid; i < count; i += MARKERS_GROUP_SIZE)
+		plateau[i] = i == best;
+	do
 	{
-		for(int i = 0; i < seeds; ++i)
+		barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+		if(lid == 0)
+			changed = 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		for(int i = lid; i < count; i += MARKERS_GROUP_SIZE)
 		{
-			int index = seedIndex[i];
-			node = validSeed(startIndex, endIndex, index, indices);
-			if(node != -1 && gradient[index] == minGradient)
+			if(plateau[i] || gradient[pixels[i]] != level)
+				continue;
+			for(int n = 0; n < connectivity; ++n)
 			{
-				// color seed
-				markers[index + 1] = 255;
-
-				// mark seed as visited
-				indexVisited[node] = true;
-
-				// get surrounding nodes
-				N = index - (width*3);
-				S = index + (width*3);
-				E = index + 3;
-				W = index - 3;
-				NE = index - (width*3) + 3;
-				NW = index - (width*3) - 3;
-				SE = index + (width*3) + 3;
-				SW = index + (width*3) - 3;
-
-				// rewrite seedIndex array
-				node = validSeed(startIndex, endIndex, N, indices);
-				if(node != -1 && !indexVisited[node])
-				{
-					seedIndex[offset] = N;
-					offset = offset + 1;
-				}
-				node = validSeed(startIndex, endIndex, S, indices);
-				if(node != -1 && !indexVisited[node])
-				{
-					seedIndex[offset] = S;
-					offset = offset + 1;
-				}
-				node = validSeed(startIndex, endIndex, E, indices);
-				if(node != -1 && !indexVisited[node])
-				{
-					seedIndex[offset] = E;
-					offset = offset + 1;
-				}
-				node = validSeed(startIndex, endIndex, W, indices);
-				if(node != -1 && !indexVisited[node])
-				{
-					seedIndex[offset] = W;
-					offset = offset + 1;
-				}
-				node = validSeed(startIndex, endIndex, NE, indices);
-				if(node != -1 && !indexVisited[node])
-				{
-					seedIndex[offset] = NE;
-					offset = offset + 1;
-				}
-				node = validSeed(startIndex, endIndex, NW, indices);
-				if(node != -1 && !indexVisited[node])
-				{
-					seedIndex[offset] = NW;
-					offset = offset + 1;
-				}
-				node = validSeed(startIndex, endIndex, SE, indices);
-				if(node != -1 && !indexVisited[node])
-				{
-					seedIndex[offset] = SE;
-					offset = offset + 1;
-				}
-				node = validSeed(startIndex, endIndex, SW, indices);
-				if(node != -1 && !indexVisited[node])
+				const int q = cellNeighbour(width, height, pixels[i] / 3, neighbourhood[n], count, pixels, positions);
+				if(q != -1 && plateau[q])
 				{
-					seedIndex[offset] = SW;
-					offset = offset + 1;
+					plateau[i] = 1;
+					changed = 1;
+					break;
 				}
 			}
 		}
-		seeds = offset;
-		offset = 0;
+		barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+	} while(changed);
+
+	// marker pixels, the first of them in raster order seeds the basin
+	for(int i = lid; i < count; i += MARKERS_GROUP_SIZE)
+	{
+		if(plateau[i])
+		{
+			markers[pixels[i] + 1] = 255;
+			atomic_min(&first, pixels[i]);
+		}
 	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if(lid == 0)
+		seeds[cell] = first;
 }
 
-kernel void computeDistanceFromMarkers(
+#ifndef CONTOURS_TILE
+#define CONTOURS_TILE 16
+#endif
+
+/**
+ *	contours and overlay in one pass over the labels map, 2D launch of CONTOURS_TILE x CONTOURS_TILE work-groups
+ *	borders are the watershed lines dilated by their up and left neighbours,
+ *	the dark outline covers the pixels at most 2 pixels before and 1 pixel after a border
+ *	batched launches stack the images along the third dimension, lineCount holding one counter per image,
+ *	which must be filled with 0 before the launch
+ */
+kernel __attribute__((reqd_work_group_size(CONTOURS_TILE, CONTOURS_TILE, 1)))
+void computeContours(
 		const int width,
 		const int height,
-		const float gridStep,
-		global const int* markersIndices,
-		const int markersCount,
-		global unsigned char* distanceFromMarkers)
+		global const int* labels,
+		global const unsigned char* original,
+		global unsigned char* contours,
+		global unsigned char* result,
+		global int* lineCount)
 {
-	size_t id = get_global_id(0);
-	int x = id % width;
-	int y = (id / width) % height;
-
-	float dist = FLT_MAX;
-
-	for(int i = 0; i < markersCount; ++i)
+	const int x = get_global_id(0);
+	const int y = get_global_id(1);
+	const int lx = get_local_id(0);
+	const int ly = get_local_id(1);
+	const int lid = ly * CONTOURS_TILE + lx;
+	const int originX = get_group_id(0) * CONTOURS_TILE;
+	const int originY = get_group_id(1) * CONTOURS_TILE;
+	labels += batchPixels(width, height, 2);
+	original += batchPixels(width, height, 2) * 3;
+	contours += batchPixels(width, height, 2) * 3;
+	result += batchPixels(width, height, 2) * 3;
+	lineCount += get_global_id(2);
+
+	// lines with 3 pixels of halo before the tile and 1 after it, borders with 2 before and 1 after
+	local uchar lines[CONTOURS_TILE + 4][CONTOURS_TILE + 4];
+	local uchar borders[CONTOURS_TILE + 3][CONTOURS_TILE + 3];
+	local int groupLines;
+
+	if(lid == 0)
+		groupLines = 0;
+	for(int i = lid; i < (CONTOURS_TILE + 4) * (CONTOURS_TILE + 4); i += CONTOURS_TILE * CONTOURS_TILE)
 	{
-		int index = markersIndices[i];
-		int markerX = index % width;
-		int markerY = (index / width) % height;
-
-		int deltaX = markerX - x;
-		int deltaY = markerY - y;
+		int tx = i % (CONTOURS_TILE + 4);
+		int ty = i / (CONTOURS_TILE + 4);
+		int gx = originX + tx - 3;
+		int gy = originY + ty - 3;
+		lines[ty][tx] = gx >= 0 && gx < width && gy >= 0 && gy < height && labels[gy * width + gx] == 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-		dist = min(dist, sqrt( (float)(deltaX * deltaX) + (float)(deltaY * deltaY) ));
+	// dilate lines
+	for(int i = lid; i < (CONTOURS_TILE + 3) * (CONTOURS_TILE + 3); i += CONTOURS_TILE * CONTOURS_TILE)
+	{
+		int tx = i % (CONTOURS_TILE + 3);
+		int ty = i / (CONTOURS_TILE + 3);
+		int gx = originX + tx - 2;
+		int gy = originY + ty - 2;
+		borders[ty][tx] = gx < width && gy < height && (lines[ty + 1][tx + 1] || lines[ty][tx + 1] || lines[ty + 1][tx]);
 	}
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-	dist = dist * (2.0f/gridStep);
-	dist = min(255.0f, dist * 64.0f);
+	const bool inside = x < width && y < height;
+	if(inside && lines[ly + 3][lx + 3])
+		atomic_inc(&groupLines);
 
-	int res = (int)(dist);
+	if(inside)
+	{
+		const int index = 3 * (y * width + x);
+		const bool border = borders[ly + 2][lx + 2];
+		bool outline = false;
+		for(int l = 0; l < 4; ++l)
+		{
+			for(int c = 0; c < 4; ++c)
+				outline = outline || borders[ly + l][lx + c];
+		}
 
-	distanceFromMarkers[id*3] = res;
-	distanceFromMarkers[id*3+1] = res;
-	distanceFromMarkers[id*3+2] = res;
-}
+		const unsigned char value = border ? 255 : 0;
+		contours[index] = value;
+		contours[index+1] = value;
+		contours[index+2] = value;
 
-kernel void computeLabGradient(const int width, const int height, global const unsigned char* src, global unsigned char* dest)
-{
-	size_t id = get_global_id(0);
-	int x = id % width;
-	int y = (id / width) % height;
-
-	Gradient grad = computeGradient(x, y, id*3, width, height, src);
-	float gradient = sqrt((float)(grad.gx * grad.gx) + (float)(grad.gy * grad.gy));
-	int g = (int)(gradient);
+		if(border || outline)
+		{
+			const unsigned char overlay = border ? 255 : 10;
+			result[index] = overlay;
+			result[index+1] = overlay;
+			result[index+2] = overlay;
+		}
+		else
+		{
+			result[index] = original[index];
+			result[index+1] = original[index+1];
+			result[index+2] = original[index+2];
+		}
+	}
 
-	dest[id*3] = g;
-	dest[id*3+1] = g;
-	dest[id*3+2] = g;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if(lid == 0 && groupLines > 0)
+		atomic_add(lineCount, groupLines);
 }
 
 labColor rgbToLab(rgbColor color)
@@ -640,126 +911,40 @@ rgbColor labToRgb(labColor color)
 	return res;
 }
 
-Gradient computeGradient(const int x, const int y, int index, const int width, const int height, global const unsigned char* src)
+/**
+ *	pixels outside the image are black, so the borders of an image never read a neighbouring row, nor in a batch
+ *	the first or last row of the neighbouring image
+ */
+rgbColor neighbourColor(const int x, const int y, const int dx, const int dy, const int width, const int height, global const unsigned char* src)
 {
-	rgbIsland rgbMap;
-	labIsland labMap;
-	
-	if(x == 0 && y == 0)
+	rgbColor color;
+	if(x + dx < 0 || x + dx >= width || y + dy < 0 || y + dy >= height)
 	{
-		rgbMap.NW.r = 0; rgbMap.NW.g = 0; rgbMap.NW.b = 0;
-		rgbMap.N.r = 0; rgbMap.N.g = 0; rgbMap.N.b = 0;
-		rgbMap.NE.r = 0; rgbMap.NE.g = 0; rgbMap.NE.b = 0;
-		rgbMap.W.r = 0; rgbMap.W.g = 0; rgbMap.W.b = 0;
-		rgbMap.SW.r = 0; rgbMap.SW.g = 0; rgbMap.SW.b = 0;
-
-		rgbMap.E.r = src[index + 3];
-		rgbMap.E.g = src[index + 4];
-		rgbMap.E.b = src[index + 5];
-		
-		rgbMap.S.r = src[index + (3 * width)];
-		rgbMap.S.g = src[index + (3 * width) + 1];
-		rgbMap.S.b = src[index + (3 * width) + 2];
-		
-		rgbMap.SE.r = src[index + (3 * width) + 3];
-		rgbMap.SE.g = src[index + (3 * width) + 4];
-		rgbMap.SE.b = src[index + (3 * width) + 5];
-	}
-	else if(x == (width - 1) && y == 0)
-	{
-		rgbMap.NW.r = 0; rgbMap.NW.g = 0; rgbMap.NW.b = 0;
-		rgbMap.N.r = 0; rgbMap.N.g = 0; rgbMap.N.b = 0;
-		rgbMap.NE.r = 0; rgbMap.NE.g = 0; rgbMap.NE.b = 0;
-		rgbMap.E.r = 0; rgbMap.E.g = 0; rgbMap.E.b = 0;
-		rgbMap.SE.r = 0; rgbMap.SE.g = 0; rgbMap.SE.b = 0;
-
-		rgbMap.W.r = src[index - 3];
-		rgbMap.W.g = src[index - 2];
-		rgbMap.W.b = src[index - 1];
-		
-		rgbMap.S.r = src[index + (3 * width)];
-		rgbMap.S.g = src[index + (3 * width) + 1];
-		rgbMap.S.b = src[index + (3 * width) + 2];
-		
-		rgbMap.SW.r = src[index + (3 * width) - 3];
-		rgbMap.SW.g = src[index + (3 * width) - 2];
-		rgbMap.SW.b = src[index + (3 * width) - 1];
-	}
-	else if(x == 0 && y == (height - 1))
-	{
-		rgbMap.NW.r = 0; rgbMap.NW.g = 0; rgbMap.NW.b = 0;
-		rgbMap.W.r = 0; rgbMap.W.g = 0; rgbMap.W.b = 0;
-		rgbMap.SE.r = 0; rgbMap.SE.g = 0; rgbMap.SE.b = 0;
-		rgbMap.S.r = 0; rgbMap.S.g = 0; rgbMap.S.b = 0;
-		rgbMap.SW.r = 0; rgbMap.SW.g = 0; rgbMap.SW.b = 0;
-
-		rgbMap.E.r = src[index + 3];
-		rgbMap.E.g = src[index + 4];
-		rgbMap.E.b = src[index + 5];
-		
-		rgbMap.N.r = src[index - (3 * width)];
-		rgbMap.N.g = src[index - (3 * width) + 1];
-		rgbMap.N.b = src[index - (3 * width) + 2];
-		
-		rgbMap.NE.r = src[index - (3 * width) + 3];
-		rgbMap.NE.g = src[index - (3 * width) + 4];
-		rgbMap.NE.b = src[index - (3 * width) + 5];
-	}
-	else if(x == (width - 1) && y == (height - 1))
-	{
-		rgbMap.SW.r = 0; rgbMap.NW.g = 0; rgbMap.NW.b = 0;
-		rgbMap.S.r = 0; rgbMap.N.g = 0; rgbMap.N.b = 0;
-		rgbMap.SE.r = 0; rgbMap.NE.g = 0; rgbMap.NE.b = 0;
-		rgbMap.E.r = 0; rgbMap.W.g = 0; rgbMap.W.b = 0;
-		rgbMap.NE.r = 0; rgbMap.SW.g = 0; rgbMap.SW.b = 0;
-
-		rgbMap.W.r = src[index - 3];
-		rgbMap.W.g = src[index - 2];
-		rgbMap.W.b = src[index - 1];
-		
-		rgbMap.N.r = src[index - (3 * width)];
-		rgbMap.N.g = src[index - (3 * width) + 1];
-		rgbMap.N.b = src[index - (3 * width) + 2];
-		
-		rgbMap.NW.r = src[index - (3 * width) - 3];
-		rgbMap.NW.g = src[index - (3 * width) - 2];
-		rgbMap.NW.b = src[index - (3 * width) - 1];
-	}
-	else
-	{
-		rgbMap.NW.r = src[index - (3 * width) - 3];
-		rgbMap.NW.g = src[index - (3 * width) - 2];
-		rgbMap.NW.b = src[index - (3 * width) - 1];
-		
-		rgbMap.N.r = src[index - (3 * width)];
-		rgbMap.N.g = src[index - (3 * width) + 1];
-		rgbMap.N.b = src[index - (3 * width) + 2];
-		
-		rgbMap.NE.r = src[index - (3 * width) + 3];
-		rgbMap.NE.g = src[index - (3 * width) + 4];
-		rgbMap.NE.b = src[index - (3 * width) + 5];
-		
-		rgbMap.W.r = src[index - 3];
-		rgbMap.W.g = src[index - 2];
-		rgbMap.W.b = src[index - 1];
-		
-		rgbMap.E.r = src[index + 3];
-		rgbMap.E.g = src[index + 4];
-		rgbMap.E.b = src[index + 5];
-		
-		rgbMap.SW.r = src[index + (3 * width) - 3];
-		rgbMap.SW.g = src[index + (3 * width) - 2];
-		rgbMap.SW.b = src[index + (3 * width) - 1];
-		
-		rgbMap.S.r = src[index + (3 * width)];
-		rgbMap.S.g = src[index + (3 * width) + 1];
-		rgbMap.S.b = src[index + (3 * width) + 2];
-		
-		rgbMap.SE.r = src[index + (3 * width) + 3];
-		rgbMap.SE.g = src[index + (3 * width) + 4];
-		rgbMap.SE.b = src[index + (3 * width) + 5];
+		color.r = 0; color.g = 0; color.b = 0;
+		return color;
 	}
 
+	const size_t index = ((size_t)(y + dy) * width + x + dx) * 3;
+	color.r = src[index];
+	color.g = src[index + 1];
+	color.b = src[index + 2];
+	return color;
+}
+
+Gradient computeGradient(const int x, const int y, const int width, const int height, global const unsigned char* src)
+{
+	rgbIsland rgbMap;
+	labIsland labMap;
+
+	rgbMap.NW = neighbourColor(x, y, -1, -1, width, height, src);
+	rgbMap.N = neighbourColor(x, y, 0, -1, width, height, src);
+	rgbMap.NE = neighbourColor(x, y, 1, -1, width, height, src);
+	rgbMap.W = neighbourColor(x, y, -1, 0, width, height, src);
+	rgbMap.E = neighbourColor(x, y, 1, 0, width, height, src);
+	rgbMap.SW = neighbourColor(x, y, -1, 1, width, height, src);
+	rgbMap.S = neighbourColor(x, y, 0, 1, width, height, src);
+	rgbMap.SE = neighbourColor(x, y, 1, 1, width, height, src);
+
 	labMap.NW = rgbToLab(rgbMap.NW);
 	labMap.N = rgbToLab(rgbMap.N);
 	labMap.NE = rgbToLab(rgbMap.NE);
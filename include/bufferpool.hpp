@@ -0,0 +1,134 @@
+#ifndef BUFFERPOOL_HPP
+#define BUFFERPOOL_HPP
+
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <algorithm>
+#include <clprogram.hpp>
+
+enum HostBuffer
+{
+	HOST_SMOOTH,
+	HOST_SMOOTH_NEXT,
+	HOST_GRADIENT,
+	HOST_HEXAGON_GRID,
+	HOST_MARKERS,
+	HOST_DISTANCE,
+	HOST_REGULARIZED_GRADIENT,
+	HOST_CONTOURS,
+	HOST_RESULT,
+	HOST_BUFFERS
+};
+
+enum DeviceBuffer
+{
+	DEVICE_INPUT,
+	DEVICE_PING,
+	DEVICE_PONG,
+	DEVICE_GRADIENT,
+	DEVICE_MARKERS,
+	DEVICE_DISTANCE,
+	DEVICE_REGULARIZED_GRADIENT,
+	DEVICE_LABELS,
+	DEVICE_PRECISE_GRADIENT,
+	DEVICE_PRECISE_REGULARIZED_GRADIENT,
+	DEVICE_STAGING_INPUT,
+	DEVICE_STAGING_PING,
+	DEVICE_STAGING_PONG,
+	DEVICE_BUFFERS
+};
+
+enum ScratchBuffer
+{
+	SCRATCH_CELLS,
+	SCRATCH_PARENTS,
+	SCRATCH_PLATEAUS,
+	SCRATCH_BUFFERS
+};
+
+enum IndexBuffer
+{
+	INDICES_MARKERS,
+	INDICES_MARKER_OFFSETS,
+	INDICES_SEEDS,
+	INDICES_CHANGED,
+	INDICES_LINES,
+	INDICES_CELL_PIXELS,
+	INDICES_CELL_OFFSETS,
+	INDICES_CELL_POSITIONS,
+	INDICES_CELL_TREES,
+	INDICES_CELL_SEEDS,
+	INDEX_BUFFERS
+};
+
+/**
+ *	Arena holding every per-image buffer of an engine.
+ *	Buffers are sized from the image dimensions and only grow,
+ *	so images of the same size (or smaller) are processed without any allocation.
+ *	RGB buffers are width * height * 3 bytes, labels, scratch, precise levels and visited flags width * height,
+ *	every host buffer starts on a cache line.
+ *	Host buffers live in pinned memory, so transfers from and to them need no staging copy by the driver.
+ *	Device ping-pong buffers hold 8 bytes per pixel, enough for the flooding keys of the watershed,
+ *	precise buffers hold planar 16 bits levels,
+ *	device buffers are only created the first time they are asked for.
+ */
+class BufferPool
+{
+	public:
+
+		BufferPool(cl::Context & context, cl::CommandQueue & queue);
+		~BufferPool();
+
+		/**
+		 *	return true when the buffers had to be reallocated, invalidating previous pointers
+		 */
+		bool reserve(const int width, const int height);
+		unsigned char* getHost(const HostBuffer buffer);
+		int* getLabels();
+		/**
+		 *	width * height ints for the internal use of a stage
+		 */
+		int* getScratch(const ScratchBuffer buffer);
+		/**
+		 *	width * height 16 bits levels, the host copy of the precise regularized gradient
+		 */
+		unsigned short* getPrecise();
+		bool* getVisited();
+		cl::Buffer & getDevice(const DeviceBuffer buffer);
+		cl::Buffer & getIndices(const IndexBuffer buffer, const int count);
+
+		/**
+		 *	incremented on every reallocation, tells whether data left on the device is still valid
+		 */
+		int getGeneration() const;
+		/**
+		 *	bytes reserve allocates on the host for width * height pixels,
+		 *	and the most the device buffers take once every one of them has been asked for
+		 */
+		static std::size_t getHostSize(const int width, const int height);
+		static std::size_t getDeviceSize(const int width, const int height);
+
+		static constexpr std::size_t alignment{64};
+
+	private:
+
+		void release();
+
+		cl::Context context;
+		cl::CommandQueue queue;
+		int capacity;
+		cl::Buffer pinned;
+		void* mapped;
+		std::array<unsigned char*, HOST_BUFFERS> host;
+		int* labels;
+		std::array<int*, SCRATCH_BUFFERS> scratch;
+		unsigned short* precise;
+		bool* visited;
+		std::array<cl::Buffer, DEVICE_BUFFERS> device;
+		std::array<cl::Buffer, INDEX_BUFFERS> indices;
+		std::array<int, INDEX_BUFFERS> indicesCapacity;
+		int generation;
+};
+
+#endif
@@ -8,38 +8,145 @@
 #include <memory>
 #include <utility>
 #include <algorithm>
+#include <array>
+#include <list>
+#include <stdexcept>
 
 #define CL_HPP_TARGET_OPENCL_VERSION 210
 #define CL_HPP_ENABLE_EXCEPTIONS
 #include <CL/cl2.hpp>
 
+/**
+ *	2D kernels whose work-group shape is tuned per device, 16 bits variants share the shape of their 8 bits kernel
+ */
+enum TunedKernel
+{
+	TUNED_ERODE,
+	TUNED_DILATION,
+	TUNED_GRADIENT,
+	TUNED_REGULARIZED_GRADIENT,
+	TUNED_KERNELS
+};
+
+/**
+ *	no available OpenCL GPU, the other failures of the constructor are std::runtime_error
+ */
+class DeviceNotFound : public std::runtime_error
+{
+	public:
+
+		using std::runtime_error::runtime_error;
+};
+
+struct MorphologyKernels
+{
+	cl::Kernel erode;
+	cl::Kernel dilation;
+};
+
 class CLProgram
 {
 	public:
 
-		CLProgram(const std::string & file);
+		/**
+		 *	throw DeviceNotFound when no GPU is available, std::runtime_error when file can not be read
+		 *	or its program does not build, with the build log;
+		 *	verbose prints the device found and the work-group tuning, the library stays silent otherwise
+		 */
+		CLProgram(const std::string & file, const bool verbose = false);
+		bool isVerbose() const;
 		cl::Kernel & getErodeKernel();
 		cl::Kernel & getDilationKernel();
-		cl::Kernel & getOutlineKernel();
+		/**
+		 *	erode and dilation built with the image size and the radius of the structuring element as constants,
+		 *	once that key has been asked for specializeAfter times, so only repeated sizes pay for the compilation,
+		 *	video frames for instance; the generic kernels are returned until then, or when the build fails
+		 */
+		MorphologyKernels getMorphologyKernels(const int width, const int height, const int radius);
 		cl::Kernel & getGradientKernel();
 		cl::Kernel & getMarkersKernel();
-		cl::Kernel & getDistanceKernel();
+		cl::Kernel & getRegularizedGradientKernel();
+		/**
+		 *	variants also writing 16 bits levels
+		 */
+		cl::Kernel & getPreciseGradientKernel();
+		cl::Kernel & getPreciseRegularizedGradientKernel();
+		cl::Kernel & getPrecisePropagationKernel();
+		cl::Kernel & getSeedKernel();
+		cl::Kernel & getPropagationKernel();
+		cl::Kernel & getWatershedLabelsKernel();
+		cl::Kernel & getContoursKernel();
 		cl::CommandQueue & getCommandQueue();
+		/**
+		 *	second in-order queue, work enqueued there overlaps the main queue
+		 */
+		cl::CommandQueue & getStagingQueue();
 		cl::Context & getContext();
+		cl::Device & getDevice();
+		/**
+		 *	kernel a tuned shape applies to, the 8 bits one
+		 */
+		cl::Kernel & getTunedKernel(const TunedKernel kernel);
+		/**
+		 *	tuned work-group of a 2D kernel, NullRange when the driver picks it
+		 */
+		cl::NDRange getLocalSize(const TunedKernel kernel) const;
+		/**
+		 *	width x height x count rounded up to whole work-groups, the kernels skip the padding
+		 */
+		cl::NDRange getGlobalSize(const TunedKernel kernel, const int width, const int height, const int count) const;
+		/**
+		 *	0 x 0 leaves the work-group to the driver
+		 */
+		void setLocalSize(const TunedKernel kernel, const int x, const int y);
+
+		// work-group size of the markers kernel, one work-group per cell
+		static constexpr int markersGroupSize{64};
+		// side of the square work-groups of the contours kernel
+		static constexpr int contoursTileSize{16};
+		// requests of a key before its specialized program is built, and keys remembered
+		static constexpr int specializeAfter{3};
+		static constexpr std::size_t maxSpecializations{8};
 
 	private:
 
+		/**
+		 *	program of one key, without kernels until it is built
+		 */
+		struct Specialization
+		{
+			std::array<int, 3> key;
+			int requests;
+			cl::Program program;
+			MorphologyKernels kernels;
+		};
+
+		void buildSpecialization(Specialization & specialization);
+
+		bool verbose;
 		std::vector<cl::Device> devices;
 		cl::Device device;
 		cl::Context context;
 		cl::CommandQueue queue;
+		cl::CommandQueue stagingQueue;
 		cl::Program program;
 		cl::Kernel erodeKernel;
 		cl::Kernel dilationKernel;
-		cl::Kernel outlineKernel;
 		cl::Kernel gradientKernel;
 		cl::Kernel markersKernel;
-		cl::Kernel distanceKernel;
+		cl::Kernel regularizedGradientKernel;
+		cl::Kernel preciseGradientKernel;
+		cl::Kernel preciseRegularizedGradientKernel;
+		cl::Kernel precisePropagationKernel;
+		cl::Kernel seedKernel;
+		cl::Kernel propagationKernel;
+		cl::Kernel watershedLabelsKernel;
+		cl::Kernel contoursKernel;
+		std::array<std::array<int, 2>, TUNED_KERNELS> localSizes;
+		std::string source;
+		std::string options;
+		// most recently used first
+		std::list<Specialization> specializations;
 };
 
 #endif
@@ -0,0 +1,396 @@
+#ifndef ENGINE_HPP
+#define ENGINE_HPP
+
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <clprogram.hpp>
+#include <bufferpool.hpp>
+#include <hexgrid.hpp>
+#include <neighbourhood.hpp>
+#include <thread>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <array>
+#include <queue>
+#include <functional>
+#include <limits>
+#include <atomic>
+#include <omp.h>
+
+/**
+ *	union-find forest of the pixels of a cell, reused between the cells of a thread
+ */
+struct ComponentTree
+{
+	std::vector<int> order;
+	std::vector<int> parent;
+	std::vector<int> area;
+	std::vector<int> minimum;
+	std::vector<int> extinction;
+
+	/**
+	 *	capacity for a cell of pixelCount pixels, so the cells of a thread do not reallocate
+	 */
+	void reserve(const std::size_t pixelCount)
+	{
+		order.reserve(pixelCount);
+		parent.reserve(pixelCount);
+		area.reserve(pixelCount);
+		minimum.reserve(pixelCount);
+		extinction.reserve(pixelCount);
+	}
+};
+
+/**
+ *	connected pixels of equal gradient in the core of one cell
+ */
+struct Plateau
+{
+	// first pixel in raster order
+	int root;
+	// index in the cell ids
+	int cell;
+	int area;
+	bool marker;
+};
+
+/**
+ *	GUI free computation stages of the waterpixels pipeline.
+ *	Every stage works on raw RGB buffers of width * height * 3 bytes,
+ *	so it can be run on a whole image as well as on a tile of it.
+ */
+class Engine
+{
+	public:
+
+		Engine(CLProgram & program);
+		/**
+		 *	src rows are srcStride bytes apart, so decoder buffers with padded rows are read in place
+		 */
+		void computeSmooth(const int width, const int height, const int step, const unsigned char* src, const int srcStride, unsigned char* dest);
+		/**
+		 *	same as computeSmooth, but enqueued on the staging queue with its own device buffers,
+		 *	so it overlaps the stages of the previous image; src must stay alive until the event completes
+		 */
+		cl::Event enqueueSmooth(const int width, const int height, const int step, const unsigned char* src, const int srcStride, unsigned char* dest);
+		void computeLabGradient(const int width, const int height, const unsigned char* src, unsigned char* dest);
+		/**
+		 *	marker of a cell is the regional minimum of the gradient with highest area extinction in its core,
+		 *	cells are ids of the grid, the buffers cover width * height pixels from (originX, originY) of the grid;
+		 *	the plateaus of every cell are labelled in one sweep beforehand and seed the basins of computeWatershed;
+		 *	the selection runs on the device, one work-group per cell, when it takes a full work-group,
+		 *	where the gradient computed by computeLabGradient is not uploaded again
+		 */
+		void computeCellMarkers(
+				const int width,
+				const int height,
+				const HexagonGrid & grid,
+				const std::vector<int> & cellIds,
+				const int originX,
+				const int originY,
+				unsigned char* gradient,
+				unsigned char* markers);
+		/**
+		 *	distance to the nearest marker and spatial regularization in one pass,
+		 *	dest = gradient + weight * distance in half grid steps, weight being the spatial weight k of the paper
+		 *	in gradient levels; distance receives the weighted distance for display
+		 */
+		void computeRegularizedGradient(
+				const int width,
+				const int height,
+				const int step,
+				const float weight,
+				const unsigned char* markers,
+				const unsigned char* gradient,
+				unsigned char* distance,
+				unsigned char* dest);
+
+		/**
+		 *	flood the regularized gradient from the markers,
+		 *	pixels of cell i are labelled cellIds[i] + 1, watershed lines are labelled 0
+		 *	the flooding runs on the device and leaves the labels map there for computeContours
+		 */
+		void computeWatershed(
+				const int width,
+				const int height,
+				const HexagonGrid & grid,
+				const std::vector<int> & cellIds,
+				const int originX,
+				const int originY,
+				const unsigned char* markers,
+				const unsigned char* regularizedGradient,
+				int* labelsMap);
+		/**
+		 *	flood again, on the host, only the pixels closer than radius to a watershed line of labelsMap,
+		 *	which holds a close segmentation on input, usually a coarser one upsampled; labels elsewhere are kept
+		 */
+		void refineWatershed(
+				const int width,
+				const int height,
+				const HexagonGrid & grid,
+				const std::vector<int> & cellIds,
+				const int originX,
+				const int originY,
+				const unsigned char* markers,
+				const unsigned char* regularizedGradient,
+				const int radius,
+				int* labelsMap);
+
+		/**
+		 *	write thickened watershed lines, white on black, to contours
+		 *	and the original image overlaid with them and their dark outline to result,
+		 *	both in one pass over the labels map; return contour density
+		 */
+		float computeContours(
+				const int width,
+				const int height,
+				const int* labelsMap,
+				const unsigned char* original,
+				const int originalStride,
+				unsigned char* contours,
+				unsigned char* result);
+
+		/**
+		 *	Batched stages, for images too small to keep the device busy on their own, thumbnails or crops :
+		 *	count images of width * height are stacked one after the other in every buffer, image i of src
+		 *	starting height * srcStride bytes after image i - 1, and each stage is a single launch over the batch.
+		 *	Markers and flooding stay per image, on slices of the batch buffers; the single image stages
+		 *	are batches of one.
+		 */
+		void computeSmoothBatch(
+				const int count,
+				const int width,
+				const int height,
+				const int step,
+				const unsigned char* src,
+				const int srcStride,
+				unsigned char* dest);
+		void computeLabGradientBatch(const int count, const int width, const int height, const unsigned char* src, unsigned char* dest);
+		/**
+		 *	the 16 bits levels of a batch are only used within it, every image of a batch larger than one
+		 *	is flooded from the 8 bits regularized gradient
+		 */
+		void computeRegularizedGradientBatch(
+				const int count,
+				const int width,
+				const int height,
+				const int step,
+				const float weight,
+				const unsigned char* markers,
+				const unsigned char* gradient,
+				unsigned char* distance,
+				unsigned char* dest);
+		/**
+		 *	contour density of image i is written to densities[i]
+		 */
+		void computeContoursBatch(
+				const int count,
+				const int width,
+				const int height,
+				const int* labelsMap,
+				const unsigned char* original,
+				const int originalStride,
+				unsigned char* contours,
+				unsigned char* result,
+				float* densities);
+
+		/**
+		 *	labels of the region (left, top) regionWidth x regionHeight of a width * height image only,
+		 *	src pointing to the first pixel of the image, rows srcStride bytes apart.
+		 *	Every stage runs on the region and its halo, with the grid of the whole image and the cells meeting them,
+		 *	so labels are the cell index + 1 of a full-frame run and the cost follows the area of the region;
+		 *	labelsMap receives regionWidth * regionHeight labels, the host buffers of the pool are overwritten
+		 */
+		void computeRegion(
+				const int width,
+				const int height,
+				const HexagonGrid & grid,
+				const int step,
+				const float weight,
+				const unsigned char* src,
+				const int srcStride,
+				const int left,
+				const int top,
+				const int regionWidth,
+				const int regionHeight,
+				int* labelsMap);
+		/**
+		 *	margin around a region for its stages to match a full-frame run
+		 */
+		static int getRegionHalo(const int step, const HexagonGrid & grid);
+
+		/**
+		 *	select the markers on the device instead of the host threads, for pipelines keeping the gradient there;
+		 *	a fallback only, the component tree of a cell is built by a single work-item,
+		 *	ignored when the device can not run a work-group of CLProgram::markersGroupSize
+		 */
+		void setDeviceMarkers(const bool enabled);
+		/**
+		 *	flood on the host with a bucket queue instead, plateaus are then shared in arrival order
+		 */
+		void setDeviceWatershed(const bool enabled);
+		/**
+		 *	flood on the host in BlockLayout order: the levels are copied into 64 x 64 blocks beforehand
+		 *	and the labels copied back afterwards, the labels are the same as in raster order;
+		 *	pays off on images much wider than the caches, the refinement of a preview stays in raster order
+		 */
+		void setBlockFlooding(const bool enabled);
+		/**
+		 *	seconds taken by the last flooding on the host, layout conversions included
+		 */
+		double getFloodSeconds() const;
+		/**
+		 *	keep gradient and regularized gradient as 8.8 fixed point on the device and flood those
+		 *	16 bits levels, so fewer pixels end up on saturated plateaus; the RGB buffers are unchanged
+		 */
+		void setPreciseGradient(const bool enabled);
+		/**
+		 *	the flooding polls the flag and returns early once it is set, leaving the labels map incomplete
+		 */
+		void setCancelFlag(const std::atomic<bool>* flag);
+		bool isCancelled() const;
+		/**
+		 *	connectivity of the plateaus, of the marker selection and of the flooding, 8 by default
+		 */
+		void setConnectivity(const Connectivity value);
+
+		CLProgram & getProgram();
+		BufferPool & getPool();
+
+	private:
+
+		cl::Event smooth(
+				cl::CommandQueue & queue,
+				const DeviceBuffer input,
+				const DeviceBuffer first,
+				const DeviceBuffer second,
+				const int count,
+				const int width,
+				const int height,
+				const int step,
+				const unsigned char* src,
+				const int srcStride,
+				unsigned char* dest);
+		/**
+		 *	the stages below are specialized on connectivity and gradient depth,
+		 *	the public stages pick the specialization once per call
+		 */
+		template<int N, typename Level>
+		void selectMarkers(const int width, const int height, const GradientView<Level> gradient);
+		/**
+		 *	same markers and basin seeds as selectMarkers, from the cells listed in indices and offsets
+		 */
+		void computeCellMarkersDevice(const int width, const int height, const unsigned char* gradient, unsigned char* markers);
+		/**
+		 *	two pass union-find labelling of the plateaus restricted to the cores of the cells,
+		 *	bands of rows are labelled in parallel then stitched, plateau ids are written to SCRATCH_PLATEAUS
+		 */
+		template<int N, typename Level>
+		void labelPlateaus(const int width, const int height, const GradientView<Level> gradient);
+		/**
+		 *	seeds come from the selected plateaus when markers is the output of computeCellMarkers,
+		 *	otherwise from the first marker pixel of each cell
+		 */
+		void initBasins(
+				const int width,
+				const int height,
+				const HexagonGrid & grid,
+				const std::vector<int> & cellIds,
+				const int originX,
+				const int originY,
+				const unsigned char* markers);
+		void computeWatershedDevice(const int width, const int height, const std::vector<int> & cellIds, const unsigned char* regularizedGradient, const bool precise, int* labelsMap);
+		template<int N, typename Level>
+		void computeWatershedHost(const int width, const int height, const std::vector<int> & cellIds, const GradientView<Level> regularizedGradient, int* labelsMap);
+		/**
+		 *	the band around the lines is kept in SCRATCH_CELLS
+		 */
+		template<int N, typename Level>
+		void refineWatershedHost(const int width, const int height, const std::vector<int> & cellIds, const GradientView<Level> regularizedGradient, const int radius, int* labelsMap);
+		/**
+		 *	computeWatershedHost on copies of the levels and labels in BlockLayout order
+		 */
+		template<int N, typename Level>
+		void computeWatershedBlocks(const int width, const int height, const std::vector<int> & cellIds, const GradientView<Level> regularizedGradient, int* labelsMap);
+		/**
+		 *	bucket queue flooding of the unlabelled pixels from the frontier pixels, all indexed in layout,
+		 *	labelled pixels must be flagged in inQueue; Level bounds the values of regularizedGradient
+		 */
+		template<int N, typename Level, typename Layout, typename Levels, typename Flag>
+		void floodHost(const Layout & layout, const Levels regularizedGradient, int* labelsMap, Flag* inQueue);
+
+		/**
+		 *	upload data to a device buffer, unless it is what a previous stage left there
+		 */
+		void upload(const DeviceBuffer buffer, const void* data, const std::size_t size);
+		bool isResident(const DeviceBuffer buffer, const void* data) const;
+		void setResident(const DeviceBuffer buffer, const void* data);
+
+		CLProgram & program;
+		BufferPool pool;
+
+		// scratch kept between images, their capacity is reused
+		std::vector<int> indices;
+		std::vector<int> offsets;
+		std::vector<Plateau> plateaus;
+		std::vector<int> cellPlateaus;
+		// component tree of each OpenMP thread of the markers selection
+		std::vector<ComponentTree> cellTrees;
+		std::vector<int> bandOffsets;
+		std::vector<int> markersIndices;
+		std::vector<int> markersOffsets;
+		std::vector<int> basinSeeds;
+		std::vector<int> basinCells;
+		std::vector<int> cellSeeds;
+		std::vector<int> seeds;
+		std::vector<int> frontier;
+		// frontier pixels found by each OpenMP thread, in raster order
+		std::vector<std::vector<int>> threadFrontiers;
+		std::vector<int> regionCells;
+		// line pixels of each image of a contours batch
+		std::vector<int> linePixels;
+		std::vector<Span> spans;
+		std::vector<std::vector<int>> buckets;
+		std::vector<unsigned short> blockLevels;
+		std::vector<int> blockLabels;
+		std::vector<unsigned char> blockQueued;
+
+		bool deviceMarkers;
+		bool deviceWatershed;
+		bool blockFlooding;
+		double floodSeconds;
+		Connectivity connectivity;
+		bool preciseGradient;
+		const std::atomic<bool>* cancelFlag;
+
+		// markers buffer and cell count the basin seeds were selected for
+		const unsigned char* seededMarkers;
+		std::size_t seededCells;
+
+		// host buffers whose content is still on the device
+		std::array<const void*, DEVICE_BUFFERS> resident;
+		int residentGeneration;
+
+		// relaxation steps launched between two convergence checks
+		static constexpr int propagationBatch{32};
+		// rows labelled by one thread before the bands are stitched
+		static constexpr int plateauBand{32};
+};
+
+/**
+ *	return the pixel of the cell, as an index in cellPixels, of the minimum with highest area extinction,
+ *	or -1 for an empty cell, from a component tree built by union-find over the pixels sorted by gradient
+ */
+template<int N, typename Level>
+int computeCellMarker(
+		const int width,
+		const int height,
+		const int* cellPixels,
+		const int pixelCount,
+		const GradientView<Level> gradient,
+		int* positions,
+		ComponentTree & tree);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef EXPORTER_HPP
+#define EXPORTER_HPP
+
+#include <QObject>
+#include <QImage>
+#include <QImageWriter>
+#include <QThreadPool>
+#include <QString>
+#include <atomic>
+#include <vector>
+#include <omp.h>
+
+/**
+ *	lossless formats of the exported layers
+ */
+enum ExportFormat
+{
+	// deflate at its fastest level
+	EXPORT_PNG,
+	// uncompressed binary PPM, no encoding at all
+	EXPORT_PPM
+};
+
+/**
+ *	one layer to write, image must own its pixels since the engine buffers are rewritten by the next run
+ */
+struct ExportLayer
+{
+	// file name without extension
+	QString name;
+	QImage image;
+};
+
+/**
+ *	Encodes and writes layers concurrently on its own thread pool, away from the GUI thread.
+ *	Signals are emitted from the pool threads, connections to GUI objects are queued.
+ */
+class LayerExporter : public QObject
+{
+	Q_OBJECT
+
+	public:
+
+		LayerExporter(QObject* parent = nullptr);
+		/**
+		 *	waits for the files being written
+		 */
+		~LayerExporter();
+
+		void setFormat(const ExportFormat value);
+		/**
+		 *	queue one task per layer, files are written to directory as name.png or name.ppm
+		 */
+		void exportLayers(const QString & directory, const std::vector<ExportLayer> & layers);
+		bool isRunning() const;
+
+	signals:
+		/**
+		 *	seconds spent encoding and writing this file
+		 */
+		void layerExported(QString path, bool saved, double seconds);
+		/**
+		 *	seconds from exportLayers to the last file written
+		 */
+		void finished(int failures, double seconds);
+
+	private:
+
+		void layerDone(const QString & path, const bool saved, const double seconds);
+
+		QThreadPool pool;
+		ExportFormat format;
+		std::atomic<int> pending;
+		std::atomic<int> failures;
+		double start;
+
+		// zlib level 1, Qt maps quality q to level (100 - q) * 9 / 91
+		static constexpr int pngQuality{80};
+};
+
+#endif
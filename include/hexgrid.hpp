@@ -0,0 +1,84 @@
+#ifndef HEXGRID_HPP
+#define HEXGRID_HPP
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+/**
+ *	pixels begin to end of row y, bounds included
+ */
+struct Span
+{
+	int y;
+	int begin;
+	int end;
+};
+
+/**
+ *	Analytic hexagon lattice of the waterpixels grid.
+ *	Cell (x, y) is centered on (x * baseOffset, y * hexWidth), odd columns are shifted down by half a hexagon,
+ *	its id is y * slicesX + x. The outer hexagons tile the plane, the core of a cell is its hexagon
+ *	shrunk by rho around the center. Any pixel is mapped to its cell in constant time,
+ *	core rows are precomputed once for every cell since they only differ by their center.
+ */
+class HexagonGrid
+{
+	public:
+
+		HexagonGrid();
+		HexagonGrid(const int width, const int height, const int step, const float rho);
+
+		int getHexagonWidth() const;
+		int getBaseOffset() const;
+		int getSlicesX() const;
+		int getSlicesY() const;
+		int getCellCount() const;
+
+		/**
+		 *	cell whose outer hexagon holds the pixel, -1 when that hexagon is not part of the grid
+		 */
+		int cellAt(const int x, const int y) const;
+
+		/**
+		 *	true when the pixel lies in the core of the cell
+		 */
+		bool inCore(const int cell, const int x, const int y) const;
+
+		/**
+		 *	append the rows of the core of the cell to spans, top to bottom,
+		 *	in the coordinates of a width * height frame whose top left corner is (originX, originY), clipped to it
+		 */
+		void coreSpans(const int cell, const int originX, const int originY, const int width, const int height, std::vector<Span> & spans) const;
+
+		/**
+		 *	bounding box of the core of the cell in grid coordinates, bounds included
+		 */
+		void coreBounds(const int cell, int & left, int & top, int & right, int & bottom) const;
+
+		/**
+		 *	ids of the cells whose core meets the box, in grid coordinates with bounds included, in id order
+		 */
+		void coreCells(const int left, const int top, const int right, const int bottom, std::vector<int> & cellIds) const;
+
+	private:
+
+		void center(const int cell, int & x, int & y) const;
+		float norm(const int dx, const int dy) const;
+
+		int hexWidth;
+		int baseOffset;
+		int slicesX;
+		int slicesY;
+
+		// outer hexagon, half width, half length of the horizontal sides and half height
+		float halfWidth;
+		float halfSide;
+		float halfHeight;
+
+		// core hexagon, half width of each row from -coreHalfHeight to coreHalfHeight
+		int coreHalfHeight;
+		std::vector<int> coreRows;
+};
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef JOBQUEUE_HPP
+#define JOBQUEUE_HPP
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+#include <utility>
+
+/**
+ *	Bounded lock-free multi-producer multi-consumer queue.
+ *	Every slot carries a sequence number telling whether it is free for the producer of a position
+ *	or filled for its consumer, so producers and consumers only contend on their own position counter.
+ *	A full queue refuses the value instead of waiting, which is the backpressure of the caller.
+ */
+template<typename T>
+class BoundedQueue
+{
+	public:
+
+		/**
+		 *	capacity is rounded up to a power of two
+		 */
+		explicit BoundedQueue(const std::size_t capacity);
+
+		bool tryPush(T && value);
+		bool tryPop(T & value);
+		/**
+		 *	approximate while producers or consumers are running
+		 */
+		std::size_t size() const;
+		std::size_t getCapacity() const;
+
+	private:
+
+		static std::size_t roundCapacity(const std::size_t capacity);
+
+		struct Slot
+		{
+			std::atomic<std::size_t> sequence;
+			T value;
+		};
+
+		std::vector<Slot> ring;
+		std::size_t mask;
+
+		// positions on their own cache lines, producers and consumers do not share them
+		alignas(64) std::atomic<std::size_t> head;
+		alignas(64) std::atomic<std::size_t> tail;
+};
+
+template<typename T>
+BoundedQueue<T>::BoundedQueue(const std::size_t capacity) :
+	ring(roundCapacity(capacity)),
+	mask(ring.size() - 1),
+	head(0),
+	tail(0)
+{
+	for(std::size_t i{0}; i < ring.size(); ++i)
+		ring[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+template<typename T>
+std::size_t BoundedQueue<T>::roundCapacity(const std::size_t capacity)
+{
+	std::size_t size{2};
+	while(size < capacity)
+		size *= 2;
+	return size;
+}
+
+template<typename T>
+bool BoundedQueue<T>::tryPush(T && value)
+{
+	std::size_t position{tail.load(std::memory_order_relaxed)};
+	for(;;)
+	{
+		Slot & slot = ring[position & mask];
+		const std::size_t sequence{slot.sequence.load(std::memory_order_acquire)};
+		const std::ptrdiff_t difference{static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position)};
+		if(difference == 0)
+		{
+			// slot free for this position, claim it
+			if(tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+			{
+				slot.value = std::move(value);
+				slot.sequence.store(position + 1, std::memory_order_release);
+				return true;
+			}
+		}
+		else if(difference < 0)
+			return false;
+		else
+			position = tail.load(std::memory_order_relaxed);
+	}
+}
+
+template<typename T>
+bool BoundedQueue<T>::tryPop(T & value)
+{
+	std::size_t position{head.load(std::memory_order_relaxed)};
+	for(;;)
+	{
+		Slot & slot = ring[position & mask];
+		const std::size_t sequence{slot.sequence.load(std::memory_order_acquire)};
+		const std::ptrdiff_t difference{static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position + 1)};
+		if(difference == 0)
+		{
+			// slot filled for this position, take it and free it for the next lap
+			if(head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+			{
+				value = std::move(slot.value);
+				slot.value = T();
+				slot.sequence.store(position + mask + 1, std::memory_order_release);
+				return true;
+			}
+		}
+		else if(difference < 0)
+			return false;
+		else
+			position = head.load(std::memory_order_relaxed);
+	}
+}
+
+template<typename T>
+std::size_t BoundedQueue<T>::size() const
+{
+	const std::size_t first{head.load(std::memory_order_relaxed)};
+	const std::size_t last{tail.load(std::memory_order_relaxed)};
+	return last > first ? last - first : 0;
+}
+
+template<typename T>
+std::size_t BoundedQueue<T>::getCapacity() const
+{
+	return mask + 1;
+}
+
+#endif
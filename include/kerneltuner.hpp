@@ -0,0 +1,72 @@
+#ifndef KERNELTUNER_HPP
+#define KERNELTUNER_HPP
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <array>
+#include <random>
+#include <chrono>
+#include <limits>
+#include <cstdlib>
+#include <functional>
+#include <algorithm>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <clprogram.hpp>
+
+/**
+ *	Picks the work-group shape of the 2D kernels of a program on its device.
+ *	Square, wide and tall tiles are timed on a synthetic image, next to the choice of the driver,
+ *	and the winners are kept in a cache file, one line per kernel keyed by device, driver and kernel source,
+ *	so a device is only tuned again when one of them changes; within a process the shapes are also kept in memory,
+ *	so the contexts of several worker threads share one tuning.
+ *	The cache is $WATERPIXELS_TUNING_CACHE, an empty value disabling it, or waterpixels/workgroups
+ *	in the user cache directory.
+ */
+class KernelTuner
+{
+	public:
+
+		KernelTuner(CLProgram & program, const std::string & source);
+		/**
+		 *	shapes of this process or of the cache when they know this device, tuned and saved otherwise
+		 */
+		void apply();
+		static std::string getCachePath();
+
+	private:
+
+		using Shapes = std::array<std::array<int, 2>, TUNED_KERNELS>;
+
+		Shapes getShapes() const;
+		bool load(const std::string & path);
+		void save(const std::string & path) const;
+		void tune();
+		/**
+		 *	seconds taken by benchmarkRuns launches with the current shape of kernel, max when the device refuses it
+		 */
+		double measure(const TunedKernel kernel);
+		std::vector<std::array<int, 2>> getCandidates(const TunedKernel kernel);
+
+		CLProgram & program;
+		std::string deviceKey;
+		std::array<std::string, TUNED_KERNELS> kernelNames;
+
+		// shapes applied by this process, by device key; the lock also keeps two contexts from tuning at once
+		static std::mutex processLock;
+		static std::unordered_map<std::string, Shapes> processShapes;
+
+		// side of the synthetic image, one marker every benchmarkStep pixels
+		static constexpr int benchmarkSize{512};
+		static constexpr int benchmarkStep{32};
+		static constexpr int benchmarkRuns{5};
+		// smallest work-group tried, below a wavefront the device idles
+		static constexpr int minGroupSize{32};
+};
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef LAYERITEM_HPP
+#define LAYERITEM_HPP
+
+#include <QGraphicsItem>
+#include <QPainter>
+#include <QPixmap>
+#include <QImage>
+#include <QStyleOptionGraphicsItem>
+#include <array>
+#include <list>
+#include <unordered_map>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+/**
+ *	how the bytes of a layer buffer are turned into colours
+ */
+enum LayerFormat
+{
+	// RGB triplets
+	LAYER_RGB,
+	// RGB triplets, black pixels are transparent
+	LAYER_RGB_KEYED,
+	// first byte of each triplet through the colour LUT
+	LAYER_LUT
+};
+
+/**
+ *	Scene item drawing a width * height layer straight from an RGB buffer it does not own.
+ *	Only the tiles exposed at the current zoom are rendered, every 2^level pixel when zoomed out,
+ *	and the last ones are kept in an LRU cache, so no full size pixmap of the layer ever exists.
+ *	The source may be smaller than the item, it is then stretched over it.
+ */
+class LayerItem : public QGraphicsItem
+{
+	public:
+
+		LayerItem(const int width, const int height, const LayerFormat format);
+
+		/**
+		 *	rows of the source are stride bytes apart, the cache is dropped
+		 */
+		void setSource(const unsigned char* data, const int sourceWidth, const int sourceHeight, const int stride);
+		/**
+		 *	colours of the 256 levels of a LAYER_LUT layer, grey ramp by default
+		 */
+		void setLut(const std::array<QRgb, 256> & value);
+		/**
+		 *	drop the cached tiles after the source content changed
+		 */
+		void invalidate();
+		/**
+		 *	a frozen layer only draws cached tiles, its source is being rewritten by another thread
+		 */
+		void setFrozen(const bool value);
+
+		QRectF boundingRect() const override;
+		void paint(QPainter* painter, const QStyleOptionGraphicsItem* option, QWidget* widget) override;
+
+	private:
+
+		struct CachedTile
+		{
+			QPixmap pixmap;
+			std::list<std::uint64_t>::iterator age;
+		};
+
+		/**
+		 *	cached tile, rendered when missing unless the layer is frozen, null when it cannot be drawn
+		 */
+		const QPixmap* tile(const int level, const int tileX, const int tileY);
+		QPixmap render(const int level, const int tileX, const int tileY) const;
+
+		int width;
+		int height;
+		LayerFormat format;
+		std::array<QRgb, 256> lut;
+
+		const unsigned char* source;
+		int sourceWidth;
+		int sourceHeight;
+		int sourceStride;
+		bool frozen;
+
+		// most recently drawn tiles first
+		std::list<std::uint64_t> ages;
+		std::unordered_map<std::uint64_t, CachedTile> cache;
+
+		// tile side in rendered pixels
+		static constexpr int tileSize{256};
+		static constexpr int maxLevel{6};
+		static constexpr std::size_t cacheTiles{160};
+};
+
+#endif
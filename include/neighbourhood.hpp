@@ -0,0 +1,150 @@
+#ifndef NEIGHBOURHOOD_HPP
+#define NEIGHBOURHOOD_HPP
+
+#include <array>
+
+/**
+ *	pixel connectivity of the flooding and of the plateaus
+ */
+enum Connectivity
+{
+	CONNECTIVITY_4 = 4,
+	CONNECTIVITY_8 = 8
+};
+
+struct Offset
+{
+	int dx;
+	int dy;
+};
+
+/**
+ *	neighbour offsets of an N-connected pixel, known at compile time so the loops over them are unrolled;
+ *	the 4 first offsets of the 8-neighbourhood are the 4-neighbourhood, as in the device table
+ */
+template<int N>
+struct Neighbourhood;
+
+template<>
+struct Neighbourhood<4>
+{
+	static constexpr std::array<Offset, 4> offsets{{{-1, 0}, {0, -1}, {1, 0}, {0, 1}}};
+	// neighbours met before the pixel in raster order
+	static constexpr std::array<Offset, 2> previous{{{-1, 0}, {0, -1}}};
+};
+
+template<>
+struct Neighbourhood<8>
+{
+	static constexpr std::array<Offset, 8> offsets{{{-1, 0}, {0, -1}, {1, 0}, {0, 1}, {-1, -1}, {1, -1}, {1, 1}, {-1, 1}}};
+	// neighbours met before the pixel in raster order
+	static constexpr std::array<Offset, 4> previous{{{-1, 0}, {-1, -1}, {0, -1}, {1, -1}}};
+};
+
+/**
+ *	read access to a gradient by pixel index,
+ *	8 bits gradients are triplicated RGB buffers, 16 bits ones are planar
+ */
+template<typename Level>
+struct GradientView
+{
+	static constexpr int stride{sizeof(Level) == 1 ? 3 : 1};
+
+	const Level* data;
+
+	Level operator[](const int pixel) const
+	{
+		return data[pixel * stride];
+	}
+};
+
+/**
+ *	row major pixel indices, those of every other buffer
+ */
+struct RasterLayout
+{
+	int width;
+	int height;
+
+	int index(const int x, const int y) const
+	{
+		return y * width + x;
+	}
+
+	int getX(const int pixel) const
+	{
+		return pixel % width;
+	}
+
+	int getY(const int pixel) const
+	{
+		return pixel / width;
+	}
+
+	/**
+	 *	index of the neighbour at offset of pixel (x, y), which must be inside the image
+	 */
+	int neighbour(const int pixel, const int, const int, const Offset offset) const
+	{
+		return pixel + offset.dy * width + offset.dx;
+	}
+
+	int size() const
+	{
+		return width * height;
+	}
+};
+
+/**
+ *	pixel indices by blocks of side * side pixels, row major inside a block and between blocks,
+ *	so the neighbours of a pixel are in the cache lines of its block, except on the block borders;
+ *	the last blocks of a row and of a column are padded, their pixels outside the image are never reached
+ */
+struct BlockLayout
+{
+	static constexpr int shift{6};
+	static constexpr int side{1 << shift};
+	static constexpr int mask{side - 1};
+
+	int width;
+	int height;
+	int blocksX;
+
+	BlockLayout(const int width, const int height) :
+		width(width),
+		height(height),
+		blocksX((width + mask) >> shift)
+	{
+	}
+
+	int index(const int x, const int y) const
+	{
+		return (((y >> shift) * blocksX + (x >> shift)) << (2 * shift)) | ((y & mask) << shift) | (x & mask);
+	}
+
+	int getX(const int pixel) const
+	{
+		return (((pixel >> (2 * shift)) % blocksX) << shift) | (pixel & mask);
+	}
+
+	int getY(const int pixel) const
+	{
+		return (((pixel >> (2 * shift)) / blocksX) << shift) | ((pixel >> shift) & mask);
+	}
+
+	int neighbour(const int pixel, const int x, const int y, const Offset offset) const
+	{
+		const int bx{(x & mask) + offset.dx};
+		const int by{(y & mask) + offset.dy};
+		if(bx >= 0 && bx < side && by >= 0 && by < side)
+			return pixel + offset.dy * side + offset.dx;
+		return index(x + offset.dx, y + offset.dy);
+	}
+
+	int size() const
+	{
+		return blocksX * ((height + mask) >> shift) << (2 * shift);
+	}
+};
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+#include <QImageReader>
+#include <QImage>
+#include <QString>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <array>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <numeric>
+#include <limits>
+#include <unordered_map>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <engine.hpp>
+#include <jobqueue.hpp>
+#include <omp.h>
+
+/**
+ *	client socket, closed once the acceptor and the jobs still running for it have dropped it
+ */
+struct Connection
+{
+	explicit Connection(const int fd);
+	~Connection();
+	/**
+	 *	one line, written whole even when workers answer concurrently
+	 */
+	void reply(const std::string & line);
+
+	int fd;
+	std::mutex writing;
+	// bytes received after the last complete line, read by the acceptor only
+	std::string received;
+};
+
+struct SegmentationRequest
+{
+	std::shared_ptr<Connection> connection;
+	// chosen by the client, echoed in the reply
+	std::string id;
+	// image file, or shared memory object holding width * height RGB triplets when sharedInput is set
+	std::string source;
+	bool sharedInput;
+	int width;
+	int height;
+	int step;
+	float weight;
+	double received;
+};
+
+/**
+ *	request latencies, from reception to reply, in power of two millisecond bins
+ */
+class LatencyHistogram
+{
+	public:
+
+		LatencyHistogram();
+		void record(const double seconds);
+		std::string report() const;
+
+	private:
+
+		// bin i counts latencies up to 2^i ms, the last one everything above
+		static constexpr int bins{17};
+		std::array<std::atomic<std::uint64_t>, bins> counts;
+};
+
+/**
+ *	Long-lived segmentation service on a Unix domain socket.
+ *	Workers compile their program and size their buffer pool once, then serve requests from a lock-free queue,
+ *	a few at a time so the smoothing of the next image overlaps the stages of the current one.
+ *	Labels maps are returned in new shared memory objects, width * height int32 values, cell index + 1,
+ *	the client unlinks them once mapped. A full queue answers busy instead of queueing.
+ *
+ *	Requests and replies are lines of words :
+ *		segment <id> <image path | shm:<name>:<width>:<height>> <grid step> [weight]
+ *			ok <id> <labels shm name> <width> <height> <cells> <seconds> | busy <id> | error <id> <message>
+ *		stats
+ *			stats served <n> failed <n> rejected <n> queued <n> latency <bound>:<count> ...
+ *		shutdown
+ *			bye, once the queued requests are served
+ */
+class SegmentationServer
+{
+	public:
+
+		SegmentationServer(const std::string & kernelFile, const int workers);
+		bool run(const std::string & socketPath);
+
+	private:
+
+		/**
+		 *	decoded or mapped image of a request, alive until its smoothing completes
+		 */
+		struct StagedInput
+		{
+			QImage image;
+			void* mapped;
+			std::size_t mappedSize;
+			const unsigned char* data;
+			int stride;
+			std::string error;
+		};
+
+		void work();
+		void process(Engine & engine, std::vector<SegmentationRequest> & batch);
+		bool stage(const SegmentationRequest & request, StagedInput & input);
+		void release(StagedInput & input);
+		void fail(const SegmentationRequest & request, const std::string & message);
+		/**
+		 *	false on shutdown
+		 */
+		bool handleLine(const std::shared_ptr<Connection> & connection, const std::string & line);
+
+		std::string kernelFile;
+		int workers;
+		float rho;
+
+		BoundedQueue<SegmentationRequest> queue;
+		LatencyHistogram latency;
+		std::atomic<bool> stopping;
+		std::atomic<int> ready;
+		// workers whose program could not be built
+		std::atomic<int> broken;
+		std::atomic<std::uint64_t> served;
+		std::atomic<std::uint64_t> failed;
+		std::atomic<std::uint64_t> rejected;
+		std::atomic<std::uint64_t> labelsCount;
+
+		static constexpr std::size_t queueCapacity{256};
+		// requests taken by a worker at once
+		static constexpr std::size_t batchSize{8};
+		static constexpr int idleMicroseconds{200};
+		static constexpr float defaultWeight{64.0f};
+		static constexpr std::size_t maxLineLength{65536};
+		// RGB indices of the engine are ints, larger images are refused before the pool is reserved
+		static constexpr long long maxPixels{std::numeric_limits<int>::max() / 3};
+};
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef TILING_HPP
+#define TILING_HPP
+
+#include <QImageReader>
+#include <QImage>
+#include <QFile>
+#include <QRect>
+#include <QString>
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <memory>
+#include <algorithm>
+#include <future>
+#include <engine.hpp>
+
+/**
+ *	Streaming segmentation of images too large to be held in memory.
+ *	The image is decoded tile by tile, each tile is aligned on the period of the hexagon grid
+ *	and processed with a halo covering the morphology and the reach of the neighbouring markers.
+ *	Labels are the global cell indices + 1, so tiles are stitched without relabelling.
+ *	The labels map is written as raw int32, row major, width * height values.
+ *	Decoding and smoothing of the next tiles overlap the processing of the current one.
+ */
+class TiledSegmentation
+{
+	public:
+
+		TiledSegmentation(Engine & engine);
+		bool run(const QString & input, const QString & output, const int step, const int tileSize);
+
+	private:
+
+		static QImage decodeTile(const QString & input, const QRect & frame);
+
+		Engine & engine;
+		float rho;
+		float weight;
+};
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef WATERPIXELS_H
+#define WATERPIXELS_H
+
+/**
+ *	C interface of libwaterpixels.
+ *	The ABI only grows: functions are never removed nor changed, structures passed in carry their own size
+ *	so fields can be appended, and WATERPIXELS_ABI_VERSION is bumped on every addition.
+ */
+
+#include <stddef.h>
+
+#if defined(_WIN32)
+	#if defined(WATERPIXELS_BUILD)
+		#define WATERPIXELS_API __declspec(dllexport)
+	#else
+		#define WATERPIXELS_API __declspec(dllimport)
+	#endif
+#else
+	#define WATERPIXELS_API __attribute__((visibility("default")))
+#endif
+
+#define WATERPIXELS_ABI_VERSION 5
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct waterpixels_context waterpixels_context;
+
+typedef enum waterpixels_status
+{
+	WATERPIXELS_OK = 0,
+	WATERPIXELS_ERROR_ARGUMENT = 1,
+	WATERPIXELS_ERROR_DEVICE = 2,
+	WATERPIXELS_ERROR_MEMORY = 3,
+	/* no OpenCL platform or no available GPU, only returned by waterpixels_create; since ABI version 5 */
+	WATERPIXELS_ERROR_NO_DEVICE = 4,
+	/* any other failure, told by waterpixels_last_error; since ABI version 5 */
+	WATERPIXELS_ERROR_INTERNAL = 5
+} waterpixels_status;
+
+/**
+ *	how a context uses the host threads
+ */
+typedef struct waterpixels_threading
+{
+	/* sizeof(waterpixels_threading) */
+	size_t size;
+	/* OpenMP threads of the host stages of this context, 0 keeps the process default */
+	int threads;
+	/* non zero to flood on the host instead of the device */
+	int host_watershed;
+	/* non zero to flood on the host by 64 x 64 pixel blocks, for images much wider than the caches; since ABI version 4 */
+	int block_flooding;
+} waterpixels_threading;
+
+typedef struct waterpixels_params
+{
+	/* sizeof(waterpixels_params) */
+	size_t size;
+	/* grid step in pixels */
+	int step;
+	/* core of the cells, fraction of the hexagon, 2 / 3 in the paper */
+	float rho;
+	/* spatial regularization in gradient levels per half grid step, 64 by default in the GUI */
+	float weight;
+	/* 4 or 8 */
+	int connectivity;
+} waterpixels_params;
+
+/**
+ *	WATERPIXELS_ABI_VERSION of the library actually loaded
+ */
+WATERPIXELS_API unsigned int waterpixels_abi_version(void);
+
+/**
+ *	compile the OpenCL program of kernel_file, threading may be NULL for the defaults;
+ *	a context is used by one thread at a time, calls on the same context from several threads are serialized
+ */
+WATERPIXELS_API waterpixels_status waterpixels_create(const char* kernel_file, const waterpixels_threading* threading, waterpixels_context** context);
+WATERPIXELS_API void waterpixels_destroy(waterpixels_context* context);
+WATERPIXELS_API waterpixels_status waterpixels_set_threading(waterpixels_context* context, const waterpixels_threading* threading);
+
+/**
+ *	memory the context allocates for width * height images, on the host and on the device,
+ *	once allocated it is reused by every image of the same size or smaller;
+ *	a batch of count images takes what one image of width * (height * count) does
+ */
+WATERPIXELS_API waterpixels_status waterpixels_scratch_size(int width, int height, size_t* host_bytes, size_t* device_bytes);
+
+/**
+ *	segment the packed RGB triplets of rgb, whose rows are stride bytes apart, stride >= 3 * width,
+ *	into out_labels, width * height ints owned by the caller : cell index + 1, 0 on the watershed lines;
+ *	rgb is only read during the call
+ */
+WATERPIXELS_API waterpixels_status waterpixels_segment(
+		waterpixels_context* context,
+		const unsigned char* rgb,
+		int stride,
+		int width,
+		int height,
+		const waterpixels_params* params,
+		int* out_labels);
+
+/**
+ *	segment count images of width * height at once, for thumbnails or crops too small to keep the device busy
+ *	one by one : image i starts at rgb + i * height * stride and its labels at out_labels + i * width * height,
+ *	the stages on the device are single launches over the whole batch; since ABI version 2
+ */
+WATERPIXELS_API waterpixels_status waterpixels_segment_batch(
+		waterpixels_context* context,
+		const unsigned char* rgb,
+		int stride,
+		int width,
+		int height,
+		int count,
+		const waterpixels_params* params,
+		int* out_labels);
+
+/**
+ *	labels of the region (x, y) region_width x region_height of the image only, into out_labels,
+ *	region_width * region_height ints : the labels waterpixels_segment gives there on the whole image,
+ *	for a cost following the area of the region and the halo its borders need; since ABI version 3
+ */
+WATERPIXELS_API waterpixels_status waterpixels_segment_region(
+		waterpixels_context* context,
+		const unsigned char* rgb,
+		int stride,
+		int width,
+		int height,
+		const waterpixels_params* params,
+		int x,
+		int y,
+		int region_width,
+		int region_height,
+		int* out_labels);
+
+/**
+ *	message of the last error of the context, valid until its next call;
+ *	with a NULL context, message of the last waterpixels_create that failed on the calling thread, since ABI version 5
+ */
+WATERPIXELS_API const char* waterpixels_last_error(const waterpixels_context* context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -14,6 +14,10 @@
 #include <vector>
 #include <cmath>
 #include <clprogram.hpp>
+#include <engine.hpp>
+#include <worker.hpp>
+#include <layeritem.hpp>
+#include <exporter.hpp>
 #include <thread>
 #include <memory>
 #include <utility>
@@ -27,27 +31,25 @@
 
 struct Image
 {
-	QPainter painter;
-
-	QPixmap original;
-	QPixmap smooth;
-	QPixmap gradient;
-	QPixmap regularizedGradient;
-	QPixmap contours;
-	QPixmap result;
-	
-	QGraphicsPixmapItem* originalItem;
-	QGraphicsPixmapItem* smoothItem;
-	QGraphicsPixmapItem* gradientItem;
-	QGraphicsPixmapItem* regularizedGradientItem;
-	QGraphicsPixmapItem* resultItem;
-
-	unsigned char* originalRAW;
-	std::unique_ptr<unsigned char[]> smoothRAW;
+	QImage originalImage; // decoded once as RGB888, owns the pixels read by the pipeline
+	QImage preview; // downscaled result shown until the full resolution one is done
+
+	// layers draw the buffers below in place
+	LayerItem* originalItem;
+	LayerItem* smoothItem;
+	LayerItem* gradientItem;
+	LayerItem* regularizedGradientItem;
+	LayerItem* resultItem;
+
+	const unsigned char* originalRAW; // view on originalImage, rows are originalStride bytes apart
+	int originalStride;
+	// buffers below are owned by the engine buffer pool
+	unsigned char* smoothRAW;
 	unsigned char* gradientRAW;
 	unsigned char* regularizedGradientRAW;
-	std::unique_ptr<int[]> labelsMap;
-	std::unique_ptr<unsigned char[]> contoursRAW;
+	int* labelsMap;
+	unsigned char* contoursRAW;
+	unsigned char* resultRAW;
 	
 	int width;
 	int height;
@@ -58,20 +60,18 @@ struct Grid
 {
 	int step;
 	float rho;
+	float weight; // spatial regularization, in gradient levels per half grid step
 	int cellCenters;
 
-	QPixmap hexagonGrid;
-	QPixmap markers;
-	QPixmap distanceFromMarkers;
-
-	QGraphicsPixmapItem* hexagonGridItem;
-	QGraphicsPixmapItem* markersItem;
-	QGraphicsPixmapItem* distanceFromMarkersItem;
+	LayerItem* hexagonGridItem;
+	LayerItem* markersItem;
+	LayerItem* distanceFromMarkersItem;
 
 	unsigned char* hexagonGridRAW;
 	unsigned char* markersRAW;
 	unsigned char* distanceFromMarkersRAW;
-	std::vector<QPolygon> cells; // stride between cells is 12 => 6 points with x and y data
+	HexagonGrid lattice;
+	std::vector<int> cellIds; // index of each cell in the grid
 };
 
 class Window : public QMainWindow
@@ -88,6 +88,13 @@ class Window : public QMainWindow
 		void saveDoc();
 		void computeHexagonGrid();
 		void computeWaterpixels();
+		void cancelWaterpixels();
+		void layerExported(QString path, bool saved, double seconds);
+		void exportFinished(int failures, double seconds);
+		void previewFinished(QImage result);
+		void stageFinished(int stage);
+		void waterpixelsFinished(float contourDensity, double seconds);
+		void waterpixelsCancelled();
 		void showOriginalImage();
 		void hideOriginalImage();
 		void showSmooth();
@@ -110,17 +117,20 @@ class Window : public QMainWindow
 		void createMenus();
 		void createStatusBar();
 		bool loadImage(const QString & path);
-		void drawCell(const int x, const int y, const int slicesX, const int slicesY, const int hexWidth);
-		void computeSmooth();
-		void computeLabGradient();
-		void computeCellMarkers();
-		void computeDistanceFromMarkers();
-		void computeRegularizedGradient();
-
-		void computeWatershed();
-		void initBasins(std::vector<std::vector<int>> & basins);
-		void printBasins(std::vector<std::vector<int>> & basins, bool details = false);
-		bool validIndex(int index);
+		void setRunning(const bool running);
+		/**
+		 *	hidden layer item drawing an image sized buffer
+		 */
+		LayerItem* addLayer(const unsigned char* data, const int stride, const LayerFormat format, const qreal z);
+		/**
+		 *	show the layer once its buffer holds a new stage output
+		 */
+		void refreshLayer(LayerItem* item);
+		void updateSmooth();
+		void updateLabGradient();
+		void updateCellMarkers();
+		void updateRegularizedGradient();
+		void updateContours();
 
 		QMenu* menuFile;
 		QMenu* menuImage;
@@ -128,9 +138,12 @@ class Window : public QMainWindow
 		
 		QAction* openImageAction;
 		QAction* saveDocAction;
+		QAction* rawExportAction;
 		QAction* quitAction;
 		QAction* computeGridAction;
 		QAction* computeWaterpixelsAction;
+		QAction* cancelAction;
+		QAction* previewAction;
 		QAction* showOriginalImageAction;
 		QAction* hideOriginalImageAction;
 		QAction* showSmoothAction;
@@ -149,53 +162,20 @@ class Window : public QMainWindow
 		QAction* hideContoursAction;
 
 		QStatusBar* status;
+		QProgressBar* progress;
 
 		QGraphicsScene* scene;
 		QGraphicsView* view;
 
 		CLProgram program;
+		Engine engine;
 
 		struct Image img;
 		struct Grid grid;
 
-		double start;
-		double end;
+		QThread workerThread;
+		PipelineWorker* worker;
+		LayerExporter* exporter;
 };
 
-void computeCellMarkersThread(
-				const int thr,
-				const int numThreads,
-				int width,
-				int cellCenters,
-				std::vector<int>& indices,
-				std::vector<int>& indicesCount,
-				unsigned char* gradient,
-				unsigned char* markers);
-
-int growRegion(
-			const int width,
-			const int seedIndex,
-			const int startIndex,
-			const int endIndex,
-			std::vector<int>& indices,
-			unsigned char* gradient,
-			const int minGradient,
-			bool indexVisited[]);
-
-/**
- *	return index of the found seed in the indices tab
- */
-int validSeed(const int startIndex, const int endIndex, const int seedIndex, std::vector<int>& indices);
-
-void colorMaxRegion(
-				const int width,
-				const int seedIndex,
-				const int startIndex,
-				const int endIndex,
-				std::vector<int>& indices,
-				unsigned char* gradient,
-				const int minGradient,
-				unsigned char* markers,
-				bool indexVisited[]);
-
 #endif
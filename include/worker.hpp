@@ -0,0 +1,114 @@
+#ifndef WORKER_HPP
+#define WORKER_HPP
+
+#include <QObject>
+#include <QImage>
+#include <atomic>
+#include <vector>
+#include <engine.hpp>
+#include <hexgrid.hpp>
+#include <omp.h>
+
+enum PipelineStage
+{
+	STAGE_SMOOTH,
+	STAGE_GRADIENT,
+	STAGE_MARKERS,
+	STAGE_REGULARIZATION,
+	STAGE_WATERSHED,
+	STAGE_CONTOURS,
+	PIPELINE_STAGES
+};
+
+/**
+ *	inputs and outputs of one waterpixels run, buffers belong to the engine pool
+ */
+struct PipelineJob
+{
+	int width;
+	int height;
+	int step;
+	float rho;
+	float weight;
+	// run the stages on a downscaled copy first, then flood at full resolution only around its lines
+	bool preview;
+	const unsigned char* original;
+	int originalStride;
+	HexagonGrid lattice;
+	std::vector<int> cellIds;
+
+	unsigned char* smooth;
+	unsigned char* gradient;
+	unsigned char* markers;
+	unsigned char* distance;
+	unsigned char* regularizedGradient;
+	int* labelsMap;
+	unsigned char* contours;
+	unsigned char* result;
+};
+
+/**
+ *	Runs the waterpixels stages away from the GUI thread.
+ *	It lives in its own thread, the engine must not be used by anyone else while a run is going,
+ *	each output buffer is complete once the signal of its stage is emitted.
+ */
+class PipelineWorker : public QObject
+{
+	Q_OBJECT
+
+	public:
+
+		PipelineWorker(Engine & engine);
+		/**
+		 *	to be called while no run is going
+		 */
+		void setJob(const PipelineJob & value);
+		/**
+		 *	thread safe, the run stops at the next checkpoint of the engine or between two stages
+		 */
+		void cancel();
+
+	public slots:
+		void run();
+
+	signals:
+		/**
+		 *	result of the downscaled run, to be stretched over the image until the full resolution one is done
+		 */
+		void previewFinished(QImage result);
+		void stageFinished(int stage);
+		/**
+		 *	seconds from the smoothing to the end of the watershed, as the former synchronous run reported
+		 */
+		void finished(float contourDensity, double seconds);
+		void cancelled();
+
+	private:
+
+		/**
+		 *	largest downscale factor whose lattice is the full one scaled exactly, so cell ids agree; 1 when there is none
+		 */
+		int previewFactor() const;
+		/**
+		 *	whole pipeline on the image downscaled by factor, labels are kept in previewLabels;
+		 *	return false when cancelled
+		 */
+		bool runPreview(const int factor);
+		/**
+		 *	nearest neighbour upsampling of previewLabels into the labels map of the job
+		 */
+		void upsamplePreview(const int factor);
+
+		Engine & engine;
+		PipelineJob job;
+		std::atomic<bool> cancelRequested;
+
+		QImage previewOriginal;
+		std::vector<int> previewLabels;
+
+		static constexpr int previewMaxFactor{8};
+		// below this grid step the downscaled markers are not worth refining
+		static constexpr int previewMinStep{8};
+};
+
+#endif
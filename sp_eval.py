@@ -6,6 +6,13 @@ from PIL import Image
 import numpy as np
 import matplotlib.pyplot as plt
 
+# segment in process when the engine module is built, otherwise read the contours saved by the GUI
+try:
+    import pywaterpixels
+    segmenter = pywaterpixels.Segmenter("clkernel/waterpixels.cl")
+except ImportError:
+    segmenter = None
+
 folders = np.array(["landscape", "tiger", "eskimo", "fish", "elephant"])
 BR_imgs = dict()
 avg_dist_imgs = dict()
@@ -158,8 +165,13 @@ def compute_dist_to_closest_sp_pixel():
     for f in folders:
         print("computing image : " + f)
         gt_img = Image.open("imgs/" + f + "_groundTruth.png")
+        if segmenter is not None:
+            image = np.asarray(Image.open("imgs/" + f + ".jpg").convert("RGB"))
         for i in range(5, 31, 5):
-            sp_img = Image.open("build/" + f + "/" + f + "_" + str(i) + "/" + "contours.jpg")
+            if segmenter is not None:
+                labels, sp_img = segmenter.segment(image, i, contours=True)
+            else:
+                sp_img = Image.open("build/" + f + "/" + f + "_" + str(i) + "/" + "contours.png")
             boundary_recall(sp_img, gt_img, f + "_" + str(i))
         os.system("mkdir graphs/" + f)
         graph(f)
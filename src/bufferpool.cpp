@@ -0,0 +1,152 @@
+#include "bufferpool.hpp"
+
+namespace
+{
+	std::size_t aligned(const std::size_t size)
+	{
+		return (size + BufferPool::alignment - 1) / BufferPool::alignment * BufferPool::alignment;
+	}
+
+	// bytes per pixel of the device buffers, ping-pong buffers also carry 64 bits flooding keys
+	constexpr std::array<int, DEVICE_BUFFERS> deviceBytesPerPixel{3, 8, 8, 3, 3, 3, 3, sizeof(int), 2, 2, 3, 3, 3};
+}
+
+BufferPool::BufferPool(cl::Context & context, cl::CommandQueue & queue) :
+	context(context),
+	queue(queue),
+	capacity(0),
+	mapped(nullptr),
+	labels(nullptr),
+	precise(nullptr),
+	visited(nullptr),
+	generation(0)
+{
+	host.fill(nullptr);
+	scratch.fill(nullptr);
+	indicesCapacity.fill(0);
+}
+
+BufferPool::~BufferPool()
+{
+	release();
+}
+
+void BufferPool::release()
+{
+	if(mapped == nullptr)
+		return;
+
+	queue.enqueueUnmapMemObject(pinned, mapped);
+	queue.finish();
+	mapped = nullptr;
+	pinned = cl::Buffer();
+}
+
+bool BufferPool::reserve(const int width, const int height)
+{
+	const int pixels{width * height};
+	if(pixels <= capacity)
+		return false;
+
+	// one pinned block, split into the host buffers
+	const std::size_t rgbSize{aligned(static_cast<std::size_t>(pixels) * 3)};
+	const std::size_t labelsSize{aligned(static_cast<std::size_t>(pixels) * sizeof(int))};
+	const std::size_t preciseSize{aligned(static_cast<std::size_t>(pixels) * sizeof(unsigned short))};
+	const std::size_t total{getHostSize(width, height)};
+
+	release();
+	pinned = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, total + alignment);
+	mapped = queue.enqueueMapBuffer(pinned, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, total + alignment);
+
+	unsigned char* cursor{static_cast<unsigned char*>(mapped)};
+	cursor += (alignment - reinterpret_cast<std::uintptr_t>(cursor) % alignment) % alignment;
+	for(int i{0}; i < HOST_BUFFERS; ++i)
+	{
+		host[i] = cursor;
+		cursor += rgbSize;
+	}
+	labels = reinterpret_cast<int*>(cursor);
+	cursor += labelsSize;
+	for(int i{0}; i < SCRATCH_BUFFERS; ++i)
+	{
+		scratch[i] = reinterpret_cast<int*>(cursor);
+		cursor += labelsSize;
+	}
+	precise = reinterpret_cast<unsigned short*>(cursor);
+	cursor += preciseSize;
+	visited = reinterpret_cast<bool*>(cursor);
+
+	// device buffers are created again on demand
+	device.fill(cl::Buffer());
+
+	capacity = pixels;
+	generation++;
+	return true;
+}
+
+unsigned char* BufferPool::getHost(const HostBuffer buffer)
+{
+	return host[buffer];
+}
+
+int* BufferPool::getLabels()
+{
+	return labels;
+}
+
+int* BufferPool::getScratch(const ScratchBuffer buffer)
+{
+	return scratch[buffer];
+}
+
+unsigned short* BufferPool::getPrecise()
+{
+	return precise;
+}
+
+bool* BufferPool::getVisited()
+{
+	return visited;
+}
+
+cl::Buffer & BufferPool::getDevice(const DeviceBuffer buffer)
+{
+	if(device[buffer]() == nullptr)
+		device[buffer] = cl::Buffer(context, CL_MEM_READ_WRITE, static_cast<std::size_t>(capacity) * deviceBytesPerPixel[buffer]);
+	return device[buffer];
+}
+
+cl::Buffer & BufferPool::getIndices(const IndexBuffer buffer, const int count)
+{
+	// grow geometrically, indices counts barely change between images of a batch
+	if(count > indicesCapacity[buffer])
+	{
+		indicesCapacity[buffer] = std::max(count, 2 * indicesCapacity[buffer]);
+		indices[buffer] = cl::Buffer(context, CL_MEM_READ_WRITE, indicesCapacity[buffer] * sizeof(int));
+		generation++;
+	}
+	return indices[buffer];
+}
+
+int BufferPool::getGeneration() const
+{
+	return generation;
+}
+
+std::size_t BufferPool::getHostSize(const int width, const int height)
+{
+	const std::size_t pixels{static_cast<std::size_t>(width) * height};
+	const std::size_t rgbSize{aligned(pixels * 3)};
+	const std::size_t labelsSize{aligned(pixels * sizeof(int))};
+	const std::size_t preciseSize{aligned(pixels * sizeof(unsigned short))};
+	const std::size_t visitedSize{aligned(pixels * sizeof(bool))};
+	return rgbSize * HOST_BUFFERS + (1 + SCRATCH_BUFFERS) * labelsSize + preciseSize + visitedSize;
+}
+
+std::size_t BufferPool::getDeviceSize(const int width, const int height)
+{
+	std::size_t bytesPerPixel{0};
+	for(const int bytes : deviceBytesPerPixel)
+		bytesPerPixel += bytes;
+	return static_cast<std::size_t>(width) * height * bytesPerPixel;
+}
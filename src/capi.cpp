@@ -0,0 +1,356 @@
+#include "waterpixels.h"
+#include <engine.hpp>
+#include <string>
+#include <mutex>
+#include <new>
+#include <memory>
+#include <exception>
+#include <numeric>
+#include <cstddef>
+
+// structures of an older caller are shorter, fields it does not know keep their defaults
+#define WATERPIXELS_PROVIDES(value, type, field) ((value)->size >= offsetof(type, field) + sizeof((value)->field))
+
+struct waterpixels_context
+{
+	waterpixels_context(const char* kernelFile);
+
+	CLProgram program;
+	Engine engine;
+	int threads;
+	std::vector<int> cellIds;
+	std::string error;
+	std::mutex running;
+};
+
+waterpixels_context::waterpixels_context(const char* kernelFile) :
+	program(kernelFile),
+	engine(program),
+	threads(0)
+{
+}
+
+namespace
+{
+	struct SegmentationParams
+	{
+		int step;
+		float rho;
+		float weight;
+		int connectivity;
+	};
+
+	SegmentationParams readParams(const waterpixels_params* params)
+	{
+		// defaults of the GUI for the fields an older caller does not pass
+		SegmentationParams values{0, 2.0f / 3.0f, 64.0f, CONNECTIVITY_8};
+		if(WATERPIXELS_PROVIDES(params, waterpixels_params, step))
+			values.step = params->step;
+		if(WATERPIXELS_PROVIDES(params, waterpixels_params, rho))
+			values.rho = params->rho;
+		if(WATERPIXELS_PROVIDES(params, waterpixels_params, weight))
+			values.weight = params->weight;
+		if(WATERPIXELS_PROVIDES(params, waterpixels_params, connectivity))
+			values.connectivity = params->connectivity;
+		return values;
+	}
+
+	// waterpixels_create has no context to keep its error in
+	thread_local std::string createError;
+
+	/**
+	 *	status and message of the exception being handled, called from a catch block only,
+	 *	so no exception leaves the library through an exported function
+	 */
+	waterpixels_status caughtStatus(std::string & error)
+	{
+		try
+		{
+			throw;
+		}
+		catch(const std::bad_alloc &)
+		{
+			error = "out of host memory";
+			return WATERPIXELS_ERROR_MEMORY;
+		}
+		catch(const DeviceNotFound & notFound)
+		{
+			error = notFound.what();
+			return WATERPIXELS_ERROR_NO_DEVICE;
+		}
+		catch(const cl::Error & clError)
+		{
+			error = std::string("OpenCL error ") + std::to_string(clError.err()) + " in " + clError.what();
+			return WATERPIXELS_ERROR_DEVICE;
+		}
+		catch(const std::exception & exception)
+		{
+			error = exception.what();
+			return WATERPIXELS_ERROR_INTERNAL;
+		}
+		catch(...)
+		{
+			error = "unknown error";
+			return WATERPIXELS_ERROR_INTERNAL;
+		}
+	}
+
+	bool checkParams(waterpixels_context* context, const SegmentationParams & values, const HexagonGrid & grid)
+	{
+		if(values.step <= 0 || grid.getCellCount() == 0 || (values.connectivity != CONNECTIVITY_4 && values.connectivity != CONNECTIVITY_8))
+		{
+			context->error = "grid step or connectivity out of range for this image";
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 *	call of an exported function on a context, serialized with the other calls on it;
+	 *	call returns a status, its exceptions are turned into a status and a message
+	 */
+	template<typename Call>
+	waterpixels_status guarded(waterpixels_context* context, const Call & call)
+	{
+		// the lock outlives the try block, the message is written under it
+		std::unique_lock<std::mutex> lock(context->running, std::defer_lock);
+		try
+		{
+			lock.lock();
+			const waterpixels_status status{call()};
+			if(status == WATERPIXELS_OK)
+				context->error.clear();
+			return status;
+		}
+		catch(...)
+		{
+			return caughtStatus(context->error);
+		}
+	}
+
+	/**
+	 *	run the stages with the threads of the context, the thread count is an OpenMP setting
+	 *	of the calling thread, it is restored on return or on error
+	 */
+	template<typename Stages>
+	void runStages(waterpixels_context* context, const Stages & stages)
+	{
+		const int previousThreads{omp_get_max_threads()};
+		if(context->threads > 0)
+			omp_set_num_threads(context->threads);
+
+		try
+		{
+			stages();
+		}
+		catch(...)
+		{
+			omp_set_num_threads(previousThreads);
+			throw;
+		}
+		omp_set_num_threads(previousThreads);
+	}
+
+	waterpixels_status applyThreading(waterpixels_context* context, const waterpixels_threading* threading)
+	{
+		if(threading == nullptr)
+			return WATERPIXELS_OK;
+		if(!WATERPIXELS_PROVIDES(threading, waterpixels_threading, size))
+		{
+			context->error = "threading size is not set";
+			return WATERPIXELS_ERROR_ARGUMENT;
+		}
+		if(WATERPIXELS_PROVIDES(threading, waterpixels_threading, threads))
+			context->threads = std::max(0, threading->threads);
+		if(WATERPIXELS_PROVIDES(threading, waterpixels_threading, host_watershed))
+			context->engine.setDeviceWatershed(threading->host_watershed == 0);
+		if(WATERPIXELS_PROVIDES(threading, waterpixels_threading, block_flooding))
+			context->engine.setBlockFlooding(threading->block_flooding != 0);
+		return WATERPIXELS_OK;
+	}
+}
+
+unsigned int waterpixels_abi_version(void)
+{
+	return WATERPIXELS_ABI_VERSION;
+}
+
+waterpixels_status waterpixels_create(const char* kernel_file, const waterpixels_threading* threading, waterpixels_context** context)
+{
+	if(kernel_file == nullptr || context == nullptr)
+		return WATERPIXELS_ERROR_ARGUMENT;
+
+	*context = nullptr;
+	try
+	{
+		std::unique_ptr<waterpixels_context> created{std::make_unique<waterpixels_context>(kernel_file)};
+		const waterpixels_status status = applyThreading(created.get(), threading);
+		if(status != WATERPIXELS_OK)
+		{
+			createError = created->error;
+			return status;
+		}
+		*context = created.release();
+		createError.clear();
+		return WATERPIXELS_OK;
+	}
+	catch(...)
+	{
+		return caughtStatus(createError);
+	}
+}
+
+void waterpixels_destroy(waterpixels_context* context)
+{
+	delete context;
+}
+
+waterpixels_status waterpixels_set_threading(waterpixels_context* context, const waterpixels_threading* threading)
+{
+	if(context == nullptr)
+		return WATERPIXELS_ERROR_ARGUMENT;
+
+	return guarded(context, [&]()
+	{
+		return applyThreading(context, threading);
+	});
+}
+
+waterpixels_status waterpixels_scratch_size(int width, int height, size_t* host_bytes, size_t* device_bytes)
+{
+	if(width <= 0 || height <= 0)
+		return WATERPIXELS_ERROR_ARGUMENT;
+
+	try
+	{
+		if(host_bytes != nullptr)
+			*host_bytes = BufferPool::getHostSize(width, height);
+		if(device_bytes != nullptr)
+			*device_bytes = BufferPool::getDeviceSize(width, height);
+		return WATERPIXELS_OK;
+	}
+	catch(...)
+	{
+		std::string ignored;
+		return caughtStatus(ignored);
+	}
+}
+
+waterpixels_status waterpixels_segment(
+		waterpixels_context* context,
+		const unsigned char* rgb,
+		int stride,
+		int width,
+		int height,
+		const waterpixels_params* params,
+		int* out_labels)
+{
+	return waterpixels_segment_batch(context, rgb, stride, width, height, 1, params, out_labels);
+}
+
+waterpixels_status waterpixels_segment_batch(
+		waterpixels_context* context,
+		const unsigned char* rgb,
+		int stride,
+		int width,
+		int height,
+		int count,
+		const waterpixels_params* params,
+		int* out_labels)
+{
+	if(context == nullptr)
+		return WATERPIXELS_ERROR_ARGUMENT;
+
+	return guarded(context, [&]()
+	{
+		if(rgb == nullptr || out_labels == nullptr || params == nullptr || width <= 0 || height <= 0 || count <= 0 || stride < 3 * width)
+		{
+			context->error = "invalid image or labels buffer";
+			return WATERPIXELS_ERROR_ARGUMENT;
+		}
+
+		const SegmentationParams values{readParams(params)};
+		const HexagonGrid grid(width, height, values.step, values.rho);
+		if(!checkParams(context, values, grid))
+			return WATERPIXELS_ERROR_ARGUMENT;
+
+		runStages(context, [&]()
+		{
+			Engine & engine = context->engine;
+			engine.setConnectivity(static_cast<Connectivity>(values.connectivity));
+			context->cellIds.resize(grid.getCellCount());
+			std::iota(context->cellIds.begin(), context->cellIds.end(), 0);
+
+			BufferPool & pool = engine.getPool();
+			pool.reserve(width, height * count);
+			unsigned char* smoothRAW{pool.getHost(HOST_SMOOTH)};
+			unsigned char* gradientRAW{pool.getHost(HOST_GRADIENT)};
+			unsigned char* markersRAW{pool.getHost(HOST_MARKERS)};
+			unsigned char* distanceFromMarkersRAW{pool.getHost(HOST_DISTANCE)};
+			unsigned char* regularizedGradientRAW{pool.getHost(HOST_REGULARIZED_GRADIENT)};
+
+			// markers and flooding go image by image on slices of the batch,
+			// the labels are flooded straight into the caller buffer
+			const int step{values.step};
+			const int pixels{width * height};
+			engine.computeSmoothBatch(count, width, height, step, rgb, stride, smoothRAW);
+			engine.computeLabGradientBatch(count, width, height, smoothRAW, gradientRAW);
+			for(int i{0}; i < count; ++i)
+				engine.computeCellMarkers(width, height, grid, context->cellIds, 0, 0, gradientRAW + i * pixels * 3, markersRAW + i * pixels * 3);
+			engine.computeRegularizedGradientBatch(count, width, height, step, values.weight, markersRAW, gradientRAW, distanceFromMarkersRAW, regularizedGradientRAW);
+			for(int i{0}; i < count; ++i)
+				engine.computeWatershed(width, height, grid, context->cellIds, 0, 0, markersRAW + i * pixels * 3, regularizedGradientRAW + i * pixels * 3, out_labels + i * pixels);
+		});
+		return WATERPIXELS_OK;
+	});
+}
+
+waterpixels_status waterpixels_segment_region(
+		waterpixels_context* context,
+		const unsigned char* rgb,
+		int stride,
+		int width,
+		int height,
+		const waterpixels_params* params,
+		int x,
+		int y,
+		int region_width,
+		int region_height,
+		int* out_labels)
+{
+	if(context == nullptr)
+		return WATERPIXELS_ERROR_ARGUMENT;
+
+	return guarded(context, [&]()
+	{
+		if(rgb == nullptr || out_labels == nullptr || params == nullptr || width <= 0 || height <= 0 || stride < 3 * width)
+		{
+			context->error = "invalid image or labels buffer";
+			return WATERPIXELS_ERROR_ARGUMENT;
+		}
+		if(x < 0 || y < 0 || region_width <= 0 || region_height <= 0 || x + region_width > width || y + region_height > height)
+		{
+			context->error = "region out of the image";
+			return WATERPIXELS_ERROR_ARGUMENT;
+		}
+
+		const SegmentationParams values{readParams(params)};
+		const HexagonGrid grid(width, height, values.step, values.rho);
+		if(!checkParams(context, values, grid))
+			return WATERPIXELS_ERROR_ARGUMENT;
+
+		runStages(context, [&]()
+		{
+			context->engine.setConnectivity(static_cast<Connectivity>(values.connectivity));
+			context->engine.computeRegion(width, height, grid, values.step, values.weight, rgb, stride, x, y, region_width, region_height, out_labels);
+		});
+		return WATERPIXELS_OK;
+	});
+}
+
+const char* waterpixels_last_error(const waterpixels_context* context)
+{
+	if(context == nullptr)
+		return createError.empty() ? "no context" : createError.c_str();
+	return context->error.c_str();
+}
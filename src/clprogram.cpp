@@ -1,6 +1,8 @@
 #include "clprogram.hpp"
+#include "kerneltuner.hpp"
 
-CLProgram::CLProgram(const std::string & file)
+CLProgram::CLProgram(const std::string & file, const bool verbose) :
+	verbose(verbose)
 {
 	std::fstream stream;
 	stream.open(file, std::fstream::in);
@@ -9,6 +11,8 @@ CLProgram::CLProgram(const std::string & file)
 	stream.seekg(0, stream.end);
 	long length{stream.tellg()};
 	stream.seekg(0, stream.beg);
+	if(!stream || length < 0)
+		throw std::runtime_error("Error while trying to read file (OpenCL code) : " + file);
 
 	// create char array
 	std::unique_ptr<char[]> code{std::make_unique<char[]>(length+1)};
@@ -16,25 +20,33 @@ CLProgram::CLProgram(const std::string & file)
 	stream.read(code.get(), length);
 
 	if(!stream)
-	{
-		std::cerr << "Error while trying to read file (OpenCL code)" << std::endl;
-		std::exit(-1);
-	}
+		throw std::runtime_error("Error while trying to read file (OpenCL code) : " + file);
 
-	// get list of opencl platforms
+	// get list of opencl platforms, the loader reports a missing driver as an error
 	std::vector<cl::Platform> platforms;
-	cl::Platform::get(&platforms);
-	if(platforms.empty())
+	try
 	{
-		std::cerr << "OpenCL platforms not found." << std::endl;
-		std::exit(-1);
+		cl::Platform::get(&platforms);
 	}
+	catch(cl::Error& e)
+	{
+		platforms.clear();
+	}
+	if(platforms.empty())
+		throw DeviceNotFound("OpenCL platforms not found.");
 
-	// get first available GPU device
+	// get first available GPU device, platforms without any GPU are skipped
 	for(auto p{platforms.begin()}; p != platforms.end(); ++p)
 	{
 		std::vector<cl::Device> platformDevices;
-		p->getDevices(CL_DEVICE_TYPE_GPU, &platformDevices);
+		try
+		{
+			p->getDevices(CL_DEVICE_TYPE_GPU, &platformDevices);
+		}
+		catch(cl::Error& e)
+		{
+			continue;
+		}
 
 		for(auto d{platformDevices.begin()}; d != platformDevices.end(); ++d)
 		{
@@ -46,27 +58,31 @@ CLProgram::CLProgram(const std::string & file)
 			}
 		}
 	}
-	device = devices.at(0);
+	if(devices.empty())
+		throw DeviceNotFound("No available OpenCL GPU.");
+	device = devices.front();
 	context = cl::Context(device);
 
 	// print device name
-	std::cout << "Found device : " << device.getInfo<CL_DEVICE_NAME>() << std::endl;
+	if(verbose)
+		std::cout << "Found device : " << device.getInfo<CL_DEVICE_NAME>() << std::endl;
 
-	// command queue
+	// command queues
 	queue = cl::CommandQueue(context, device);
+	stagingQueue = cl::CommandQueue(context, device);
 
-	// compile OpenCL program for found device
-	program = cl::Program(context, code.get());
+	// compile OpenCL program for found device, source and options are kept for the specialized programs
+	source = code.get();
+	options = "-D CONTOURS_TILE=" + std::to_string(contoursTileSize) + " -D MARKERS_GROUP_SIZE=" + std::to_string(markersGroupSize);
+	program = cl::Program(context, source);
 
 	try
 	{
-		program.build(devices);
+		program.build(devices, options.c_str());
 	}
 	catch(cl::Error& e)
 	{
-		std::cerr << "OpenCL compilation error." << std::endl
-		<< program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
-		std::exit(-1);
+		throw std::runtime_error("OpenCL compilation error.\n" + program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device));
 	}
 	
 	// get erode kernel
@@ -75,17 +91,32 @@ CLProgram::CLProgram(const std::string & file)
 	// get dilation kernel
 	dilationKernel = cl::Kernel(program, "computeDilation");
 	
-	// get outline kernel
-	outlineKernel = cl::Kernel(program, "computeOutline");
-
 	// get gradient kernel
 	gradientKernel = cl::Kernel(program, "computeLabGradient");
 	
 	// get markers kernel
-	markersKernel = cl::Kernel(program, "computeMarkers");
+	markersKernel = cl::Kernel(program, "computeCellMarkers");
+
+	// get regularized gradient kernel, distance from markers included
+	regularizedGradientKernel = cl::Kernel(program, "computeRegularizedGradient");
+
+	// get 16 bits variants
+	preciseGradientKernel = cl::Kernel(program, "computePreciseLabGradient");
+	preciseRegularizedGradientKernel = cl::Kernel(program, "computePreciseRegularizedGradient");
+	precisePropagationKernel = cl::Kernel(program, "propagatePreciseWatershed");
+
+	// get watershed kernels
+	seedKernel = cl::Kernel(program, "seedWatershed");
+	propagationKernel = cl::Kernel(program, "propagateWatershed");
+	watershedLabelsKernel = cl::Kernel(program, "computeWatershedLabels");
 
-	// get distance kernel
-	distanceKernel = cl::Kernel(program, "computeDistanceFromMarkers");
+	// get contours kernel
+	contoursKernel = cl::Kernel(program, "computeContours");
+
+	// work-group shapes of the 2D kernels, timed once per device and kernel source
+	for(std::array<int, 2> & size : localSizes)
+		size = {0, 0};
+	KernelTuner(*this, code.get()).apply();
 }
 
 cl::Kernel & CLProgram::getErodeKernel()
@@ -98,9 +129,62 @@ cl::Kernel & CLProgram::getDilationKernel()
 	return dilationKernel;
 }
 
-cl::Kernel & CLProgram::getOutlineKernel()
+MorphologyKernels CLProgram::getMorphologyKernels(const int width, const int height, const int radius)
 {
-	return outlineKernel;
+	const std::array<int, 3> key{width, height, radius};
+	auto found = std::find_if(specializations.begin(), specializations.end(), [&key](const Specialization & s) { return s.key == key; });
+	if(found == specializations.end())
+	{
+		specializations.push_front(Specialization{key, 0, cl::Program(), MorphologyKernels{erodeKernel, dilationKernel}});
+		if(specializations.size() > maxSpecializations)
+			specializations.pop_back();
+	}
+	else
+		specializations.splice(specializations.begin(), specializations, found);
+
+	Specialization & specialization = specializations.front();
+	if(++specialization.requests == specializeAfter)
+		buildSpecialization(specialization);
+	return specialization.kernels;
+}
+
+void CLProgram::buildSpecialization(Specialization & specialization)
+{
+	std::string specialized{options};
+	specialized += " -D WIDTH=" + std::to_string(specialization.key[0]);
+	specialized += " -D HEIGHT=" + std::to_string(specialization.key[1]);
+	specialized += " -D RADIUS=" + std::to_string(specialization.key[2]);
+
+	try
+	{
+		specialization.program = cl::Program(context, source);
+		specialization.program.build(devices, specialized.c_str());
+		MorphologyKernels kernels{cl::Kernel(specialization.program, "computeErode"), cl::Kernel(specialization.program, "computeDilation")};
+
+		// launched with the tuned shapes of the generic kernels, a specialization that cannot take them is dropped
+		for(const TunedKernel tuned : {TUNED_ERODE, TUNED_DILATION})
+		{
+			cl::Kernel & kernel = tuned == TUNED_ERODE ? kernels.erode : kernels.dilation;
+			const std::size_t items{static_cast<std::size_t>(localSizes[tuned][0] * localSizes[tuned][1])};
+			if(items > kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device))
+				return;
+		}
+		specialization.kernels = kernels;
+	}
+	catch(cl::Error& e)
+	{
+		// the generic kernels keep serving this key, whether the build log can be read or not
+		std::cerr << "OpenCL compilation error of the specialized program." << std::endl;
+		try
+		{
+			std::cerr << specialization.program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+		}
+		catch(cl::Error&)
+		{
+			std::cerr << "(build log unavailable)" << std::endl;
+		}
+		specialization.program = cl::Program();
+	}
 }
 
 cl::Kernel & CLProgram::getGradientKernel()
@@ -113,9 +197,44 @@ cl::Kernel & CLProgram::getMarkersKernel()
 	return markersKernel;
 }
 
-cl::Kernel & CLProgram::getDistanceKernel()
+cl::Kernel & CLProgram::getRegularizedGradientKernel()
 {
-	return distanceKernel;
+	return regularizedGradientKernel;
+}
+
+cl::Kernel & CLProgram::getPreciseGradientKernel()
+{
+	return preciseGradientKernel;
+}
+
+cl::Kernel & CLProgram::getPreciseRegularizedGradientKernel()
+{
+	return preciseRegularizedGradientKernel;
+}
+
+cl::Kernel & CLProgram::getPrecisePropagationKernel()
+{
+	return precisePropagationKernel;
+}
+
+cl::Kernel & CLProgram::getSeedKernel()
+{
+	return seedKernel;
+}
+
+cl::Kernel & CLProgram::getPropagationKernel()
+{
+	return propagationKernel;
+}
+
+cl::Kernel & CLProgram::getWatershedLabelsKernel()
+{
+	return watershedLabelsKernel;
+}
+
+cl::Kernel & CLProgram::getContoursKernel()
+{
+	return contoursKernel;
 }
 
 cl::CommandQueue & CLProgram::getCommandQueue()
@@ -123,7 +242,58 @@ cl::CommandQueue & CLProgram::getCommandQueue()
 	return queue;
 }
 
+cl::CommandQueue & CLProgram::getStagingQueue()
+{
+	return stagingQueue;
+}
+
 cl::Context & CLProgram::getContext()
 {
 	return context;
 }
+
+bool CLProgram::isVerbose() const
+{
+	return verbose;
+}
+
+cl::Device & CLProgram::getDevice()
+{
+	return device;
+}
+
+cl::Kernel & CLProgram::getTunedKernel(const TunedKernel kernel)
+{
+	switch(kernel)
+	{
+		case TUNED_ERODE:
+			return erodeKernel;
+		case TUNED_DILATION:
+			return dilationKernel;
+		case TUNED_GRADIENT:
+			return gradientKernel;
+		default:
+			return regularizedGradientKernel;
+	}
+}
+
+cl::NDRange CLProgram::getLocalSize(const TunedKernel kernel) const
+{
+	const std::array<int, 2> & size = localSizes[kernel];
+	if(size[0] == 0)
+		return cl::NullRange;
+	return cl::NDRange(size[0], size[1], 1);
+}
+
+cl::NDRange CLProgram::getGlobalSize(const TunedKernel kernel, const int width, const int height, const int count) const
+{
+	const std::array<int, 2> & size = localSizes[kernel];
+	if(size[0] == 0)
+		return cl::NDRange(width, height, count);
+	return cl::NDRange((width + size[0] - 1) / size[0] * size[0], (height + size[1] - 1) / size[1] * size[1], count);
+}
+
+void CLProgram::setLocalSize(const TunedKernel kernel, const int x, const int y)
+{
+	localSizes[kernel] = {x, y};
+}
@@ -0,0 +1,1350 @@
+#include "engine.hpp"
+
+// the host stages are parallelized by their pragmas only, without the OpenMP compile flags they would run serially
+#ifndef _OPENMP
+#error "the engine must be compiled with the OpenMP flags"
+#endif
+
+Engine::Engine(CLProgram & program) :
+	program(program),
+	pool(program.getContext(), program.getCommandQueue()),
+	deviceMarkers(false),
+	deviceWatershed(true),
+	blockFlooding(false),
+	floodSeconds(0.0),
+	connectivity(CONNECTIVITY_8),
+	preciseGradient(false),
+	cancelFlag(nullptr),
+	seededMarkers(nullptr),
+	seededCells(0),
+	residentGeneration(-1)
+{
+	resident.fill(nullptr);
+}
+
+CLProgram & Engine::getProgram()
+{
+	return program;
+}
+
+BufferPool & Engine::getPool()
+{
+	return pool;
+}
+
+void Engine::setDeviceMarkers(const bool enabled)
+{
+	// the host keeps the selection when the device can not run a full work-group per cell
+	const std::size_t groupSize{program.getMarkersKernel().getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(program.getDevice())};
+	deviceMarkers = enabled && groupSize >= CLProgram::markersGroupSize;
+}
+
+void Engine::setDeviceWatershed(const bool enabled)
+{
+	deviceWatershed = enabled;
+}
+
+void Engine::setBlockFlooding(const bool enabled)
+{
+	blockFlooding = enabled;
+}
+
+double Engine::getFloodSeconds() const
+{
+	return floodSeconds;
+}
+
+void Engine::setConnectivity(const Connectivity value)
+{
+	connectivity = value;
+}
+
+void Engine::setPreciseGradient(const bool enabled)
+{
+	preciseGradient = enabled;
+}
+
+void Engine::setCancelFlag(const std::atomic<bool>* flag)
+{
+	cancelFlag = flag;
+}
+
+bool Engine::isCancelled() const
+{
+	return cancelFlag != nullptr && cancelFlag->load(std::memory_order_relaxed);
+}
+
+bool Engine::isResident(const DeviceBuffer buffer, const void* data) const
+{
+	return residentGeneration == pool.getGeneration() && resident[buffer] == data;
+}
+
+void Engine::upload(const DeviceBuffer buffer, const void* data, const std::size_t size)
+{
+	if(isResident(buffer, data))
+		return;
+
+	program.getCommandQueue().enqueueWriteBuffer(pool.getDevice(buffer), CL_FALSE, 0, size, data);
+	setResident(buffer, data);
+}
+
+void Engine::setResident(const DeviceBuffer buffer, const void* data)
+{
+	// reallocated buffers lost their content
+	if(residentGeneration != pool.getGeneration())
+	{
+		resident.fill(nullptr);
+		residentGeneration = pool.getGeneration();
+	}
+	resident[buffer] = data;
+}
+
+void Engine::computeSmooth(const int width, const int height, const int step, const unsigned char* src, const int srcStride, unsigned char* dest)
+{
+	computeSmoothBatch(1, width, height, step, src, srcStride, dest);
+}
+
+void Engine::computeSmoothBatch(
+		const int count,
+		const int width,
+		const int height,
+		const int step,
+		const unsigned char* src,
+		const int srcStride,
+		unsigned char* dest)
+{
+	smooth(program.getCommandQueue(), DEVICE_INPUT, DEVICE_PING, DEVICE_PONG, count, width, height, step, src, srcStride, dest).wait();
+}
+
+cl::Event Engine::enqueueSmooth(const int width, const int height, const int step, const unsigned char* src, const int srcStride, unsigned char* dest)
+{
+	cl::Event done{smooth(program.getStagingQueue(), DEVICE_STAGING_INPUT, DEVICE_STAGING_PING, DEVICE_STAGING_PONG, 1, width, height, step, src, srcStride, dest)};
+	program.getStagingQueue().flush();
+	return done;
+}
+
+cl::Event Engine::smooth(
+		cl::CommandQueue & queue,
+		const DeviceBuffer input,
+		const DeviceBuffer first,
+		const DeviceBuffer second,
+		const int count,
+		const int width,
+		const int height,
+		const int step,
+		const unsigned char* src,
+		const int srcStride,
+		unsigned char* dest)
+{
+	// sizes that repeat get kernels built for them, radius as computed by the kernels from the step
+	MorphologyKernels morphology{program.getMorphologyKernels(width, height, std::max(2, step / 16) / 2)};
+	cl::Kernel erodeKernel = morphology.erode;
+	cl::Kernel dilationKernel = morphology.dilation;
+
+	// the images of a batch are stacked, the pool sees them as one tall image
+	pool.reserve(width, height * count);
+	cl::Buffer & originalImage = pool.getDevice(input);
+	cl::Buffer & ping = pool.getDevice(first);
+	cl::Buffer & pong = pool.getDevice(second);
+
+	// prepare data for first erosion, padded source rows are packed by the transfer itself
+	const int nbElems{width * height * count * 3};
+	const std::array<size_t, 3> origin{0, 0, 0};
+	const std::array<size_t, 3> region{static_cast<size_t>(width * 3), static_cast<size_t>(height * count), 1};
+	queue.enqueueWriteBufferRect(originalImage, CL_FALSE, origin, origin, region, width * 3, 0, srcStride, 0, src);
+
+	// set erode kernel parameters
+	erodeKernel.setArg(0, step);
+	erodeKernel.setArg(1, width);
+	erodeKernel.setArg(2, height);
+	erodeKernel.setArg(3, originalImage);
+	erodeKernel.setArg(4, ping);
+	erodeKernel.setArg(5, 0);
+
+	// launch kernel on the compute device
+	queue.enqueueNDRangeKernel(erodeKernel, cl::NullRange, program.getGlobalSize(TUNED_ERODE, width, height, count), program.getLocalSize(TUNED_ERODE));
+
+	// set dilation kernel parameters, intermediate results stay on the device
+	dilationKernel.setArg(0, step);
+	dilationKernel.setArg(1, width);
+	dilationKernel.setArg(2, height);
+	dilationKernel.setArg(3, ping);
+	dilationKernel.setArg(4, pong);
+	dilationKernel.setArg(5, 0);
+
+	// launch kernel on the compute device
+	queue.enqueueNDRangeKernel(dilationKernel, cl::NullRange, program.getGlobalSize(TUNED_DILATION, width, height, count), program.getLocalSize(TUNED_DILATION));
+
+	// set dilation kernel parameters
+	dilationKernel.setArg(3, pong);
+	dilationKernel.setArg(4, ping);
+
+	// launch kernel on the compute device
+	queue.enqueueNDRangeKernel(dilationKernel, cl::NullRange, program.getGlobalSize(TUNED_DILATION, width, height, count), program.getLocalSize(TUNED_DILATION));
+
+	// set erode kernel parameters
+	erodeKernel.setArg(3, ping);
+	erodeKernel.setArg(4, pong);
+
+	// launch kernel on the compute device
+	queue.enqueueNDRangeKernel(erodeKernel, cl::NullRange, program.getGlobalSize(TUNED_ERODE, width, height, count), program.getLocalSize(TUNED_ERODE));
+	// get result back to host, the caller waits on the returned event
+	cl::Event done;
+	queue.enqueueReadBuffer(pong, CL_FALSE, 0, nbElems * sizeof(unsigned char), dest, nullptr, &done);
+	return done;
+}
+
+void Engine::computeLabGradient(const int width, const int height, const unsigned char* src, unsigned char* dest)
+{
+	computeLabGradientBatch(1, width, height, src, dest);
+}
+
+void Engine::computeLabGradientBatch(const int count, const int width, const int height, const unsigned char* src, unsigned char* dest)
+{
+	cl::CommandQueue queue = program.getCommandQueue();
+	cl::Kernel gradientKernel = preciseGradient ? program.getPreciseGradientKernel() : program.getGradientKernel();
+
+	// prepare data
+	pool.reserve(width, height * count);
+	const int nbElems{width * height * count * 3};
+	cl::Buffer & originalImage = pool.getDevice(DEVICE_INPUT);
+	cl::Buffer & gradientImage = pool.getDevice(DEVICE_GRADIENT);
+	queue.enqueueWriteBuffer(originalImage, CL_FALSE, 0, nbElems * sizeof(unsigned char), src);
+
+	// set kernel parameters
+	gradientKernel.setArg(0, width);
+	gradientKernel.setArg(1, height);
+	gradientKernel.setArg(2, originalImage);
+	gradientKernel.setArg(3, gradientImage);
+	if(preciseGradient)
+		gradientKernel.setArg(4, pool.getDevice(DEVICE_PRECISE_GRADIENT));
+
+	// launch kernel on the compute device
+	queue.enqueueNDRangeKernel(gradientKernel, cl::NullRange, program.getGlobalSize(TUNED_GRADIENT, width, height, count), program.getLocalSize(TUNED_GRADIENT));
+
+	// get result back to host, the device copies stay resident for the regularization,
+	// the 16 bits levels are only kept there
+	queue.enqueueReadBuffer(gradientImage, CL_TRUE, 0, nbElems * sizeof(unsigned char), dest);
+	setResident(DEVICE_GRADIENT, dest);
+	setResident(DEVICE_PRECISE_GRADIENT, preciseGradient ? dest : nullptr);
+}
+
+void Engine::computeCellMarkers(
+		const int width,
+		const int height,
+		const HexagonGrid & grid,
+		const std::vector<int> & cellIds,
+		const int originX,
+		const int originY,
+		unsigned char* gradient,
+		unsigned char* markers)
+{
+	// reset markers data
+	std::fill(markers, markers + width * height * 3, 0);
+
+	// prepare data, indices list the pixels which are in the core of a cell,
+	// pixels of cell i are indices[offsets[i]] to indices[offsets[i+1] - 1],
+	// cells maps every pixel to the index of its cell, -1 outside the cores
+	pool.reserve(width, height);
+	int* cells{pool.getScratch(SCRATCH_CELLS)};
+	std::fill(cells, cells + width * height, -1);
+	indices.clear();
+	offsets.clear();
+	offsets.push_back(0);
+
+	for(int i{0}; i < cellIds.size(); ++i)
+	{
+		spans.clear();
+		grid.coreSpans(cellIds.at(i), originX, originY, width, height, spans);
+		for(const Span & span : spans)
+		{
+			for(int x{span.begin}; x <= span.end; ++x)
+			{
+				indices.push_back(3 * (span.y * width + x));
+				cells[span.y * width + x] = i;
+			}
+		}
+		offsets.push_back(indices.size());
+	}
+
+	if(deviceMarkers)
+	{
+		computeCellMarkersDevice(width, height, gradient, markers);
+		seededMarkers = markers;
+		seededCells = cellIds.size();
+		return;
+	}
+
+	if(connectivity == CONNECTIVITY_4)
+		selectMarkers<4>(width, height, GradientView<unsigned char>{gradient});
+	else
+		selectMarkers<8>(width, height, GradientView<unsigned char>{gradient});
+
+	// marker of a cell is the plateau of its best minimum
+	const int* labels{pool.getScratch(SCRATCH_PLATEAUS)};
+	#pragma omp parallel for
+	for(int i = 0; i < width * height; ++i)
+	{
+		if(labels[i] != -1 && plateaus[labels[i]].marker)
+			markers[3 * i + 1] = 255;
+	}
+
+	// its root is the first marker pixel of the cell, which seeds the basin
+	basinSeeds.clear();
+	basinCells.clear();
+	for(int i{0}; i < cellPlateaus.size(); ++i)
+	{
+		if(cellPlateaus[i] != -1)
+		{
+			basinSeeds.push_back(3 * plateaus[cellPlateaus[i]].root);
+			basinCells.push_back(i);
+		}
+	}
+	seededMarkers = markers;
+	seededCells = cellIds.size();
+}
+
+void Engine::computeCellMarkersDevice(const int width, const int height, const unsigned char* gradient, unsigned char* markers)
+{
+	cl::CommandQueue queue = program.getCommandQueue();
+	cl::Kernel markersKernel = program.getMarkersKernel();
+	const int cellCount = static_cast<int>(offsets.size()) - 1;
+	const int nbElems{width * height * 3};
+
+	// index buffers first, growing one of them invalidates what is resident on the device
+	const int pixelCount = std::max<int>(1, indices.size());
+	cl::Buffer & pixelsBuffer = pool.getIndices(INDICES_CELL_PIXELS, pixelCount);
+	cl::Buffer & offsetsBuffer = pool.getIndices(INDICES_CELL_OFFSETS, offsets.size());
+	cl::Buffer & positionsBuffer = pool.getIndices(INDICES_CELL_POSITIONS, width * height);
+	cl::Buffer & treesBuffer = pool.getIndices(INDICES_CELL_TREES, 5 * pixelCount);
+	cl::Buffer & seedsBuffer = pool.getIndices(INDICES_CELL_SEEDS, std::max(1, cellCount));
+	cl::Buffer & markersBuffer = pool.getDevice(DEVICE_MARKERS);
+
+	// the gradient is only uploaded when it is not the one left on the device
+	upload(DEVICE_GRADIENT, gradient, nbElems * sizeof(unsigned char));
+	if(!indices.empty())
+		queue.enqueueWriteBuffer(pixelsBuffer, CL_FALSE, 0, indices.size() * sizeof(int), indices.data());
+	queue.enqueueWriteBuffer(offsetsBuffer, CL_FALSE, 0, offsets.size() * sizeof(int), offsets.data());
+	queue.enqueueFillBuffer(markersBuffer, static_cast<unsigned char>(0), 0, nbElems * sizeof(unsigned char));
+
+	// set kernel parameters
+	markersKernel.setArg(0, width);
+	markersKernel.setArg(1, height);
+	markersKernel.setArg(2, pixelsBuffer);
+	markersKernel.setArg(3, offsetsBuffer);
+	markersKernel.setArg(4, positionsBuffer);
+	markersKernel.setArg(5, treesBuffer);
+	markersKernel.setArg(6, pool.getDevice(DEVICE_GRADIENT));
+	markersKernel.setArg(7, markersBuffer);
+	markersKernel.setArg(8, seedsBuffer);
+	markersKernel.setArg(9, static_cast<int>(connectivity));
+
+	// launch one work-group per cell
+	if(cellCount > 0)
+		queue.enqueueNDRangeKernel(markersKernel, cl::NullRange, cellCount * CLProgram::markersGroupSize, CLProgram::markersGroupSize);
+
+	// get markers and seeds back to host, the seed of a cell is the first pixel of its marker
+	cellSeeds.resize(cellCount);
+	if(cellCount > 0)
+		queue.enqueueReadBuffer(seedsBuffer, CL_FALSE, 0, cellCount * sizeof(int), cellSeeds.data());
+	queue.enqueueReadBuffer(markersBuffer, CL_TRUE, 0, nbElems * sizeof(unsigned char), markers);
+
+	basinSeeds.clear();
+	basinCells.clear();
+	for(int i{0}; i < cellCount; ++i)
+	{
+		if(cellSeeds[i] != -1)
+		{
+			basinSeeds.push_back(cellSeeds[i]);
+			basinCells.push_back(i);
+		}
+	}
+}
+
+template<int N, typename Level>
+void Engine::selectMarkers(const int width, const int height, const GradientView<Level> gradient)
+{
+	labelPlateaus<N>(width, height, gradient);
+	const int* labels{pool.getScratch(SCRATCH_PLATEAUS)};
+
+	// cells are independent, their sizes only differ on the borders of the image,
+	// positions reuse the union-find parents which are not needed anymore
+	int* positions{pool.getScratch(SCRATCH_PARENTS)};
+	const int cellCount = static_cast<int>(offsets.size()) - 1;
+	cellPlateaus.assign(cellCount, -1);
+
+	// trees are kept between images, each thread sizes its own for the largest cell
+	std::size_t largestCell{0};
+	for(int i{0}; i < cellCount; ++i)
+		largestCell = std::max(largestCell, static_cast<std::size_t>(offsets[i+1] - offsets[i]));
+	if(cellTrees.size() < static_cast<std::size_t>(omp_get_max_threads()))
+		cellTrees.resize(omp_get_max_threads());
+	#pragma omp parallel
+	{
+		ComponentTree & tree = cellTrees[omp_get_thread_num()];
+		tree.reserve(largestCell);
+		#pragma omp for schedule(dynamic, 16)
+		for(int i = 0; i < cellCount; ++i)
+		{
+			const int* cellPixels = indices.data() + offsets[i];
+			const int best = computeCellMarker<N>(width, height, cellPixels, offsets[i+1] - offsets[i], gradient, positions, tree);
+			if(best != -1)
+			{
+				cellPlateaus[i] = labels[cellPixels[best] / 3];
+				plateaus[cellPlateaus[i]].marker = true;
+			}
+		}
+	}
+}
+
+template<int N, typename Level>
+void Engine::labelPlateaus(const int width, const int height, const GradientView<Level> gradient)
+{
+	const int* cells{pool.getScratch(SCRATCH_CELLS)};
+	int* parents{pool.getScratch(SCRATCH_PARENTS)};
+	int* labels{pool.getScratch(SCRATCH_PLATEAUS)};
+	const int bands{(height + plateauBand - 1) / plateauBand};
+
+	// roots are the first pixel of their plateau in raster order, parents always come first
+	auto find = [parents](int p) -> int
+	{
+		while(parents[p] != p)
+		{
+			parents[p] = parents[parents[p]];
+			p = parents[p];
+		}
+		return p;
+	};
+	auto merge = [&](const int p, const int q)
+	{
+		if(cells[q] != cells[p] || gradient[q] != gradient[p])
+			return;
+		const int a = find(p);
+		const int b = find(q);
+		if(a < b)
+			parents[b] = a;
+		else if(b < a)
+			parents[a] = b;
+	};
+
+	// first pass, each band only links pixels of its own rows
+	#pragma omp parallel for schedule(dynamic)
+	for(int band = 0; band < bands; ++band)
+	{
+		const int top = band * plateauBand;
+		const int bottom = std::min(height, top + plateauBand);
+		for(int y{top}; y < bottom; ++y)
+		{
+			for(int x{0}; x < width; ++x)
+			{
+				const int p = y * width + x;
+				parents[p] = p;
+				if(cells[p] == -1)
+					continue;
+
+				for(const Offset & offset : Neighbourhood<N>::previous)
+				{
+					if(x + offset.dx < 0 || x + offset.dx >= width || y + offset.dy < top)
+						continue;
+					merge(p, p + offset.dy * width + offset.dx);
+				}
+			}
+		}
+	}
+
+	// stitch the first row of each band to the last row of the previous one
+	for(int band{1}; band < bands; ++band)
+	{
+		const int y = band * plateauBand;
+		for(int x{0}; x < width; ++x)
+		{
+			const int p = y * width + x;
+			if(cells[p] == -1)
+				continue;
+
+			for(const Offset & offset : Neighbourhood<N>::previous)
+			{
+				if(offset.dy == 0 || x + offset.dx < 0 || x + offset.dx >= width)
+					continue;
+				merge(p, p + offset.dy * width + offset.dx);
+			}
+		}
+	}
+
+	// second pass, plateaus are numbered band after band in the order of their roots
+	bandOffsets.assign(bands + 1, 0);
+	#pragma omp parallel for schedule(dynamic)
+	for(int band = 0; band < bands; ++band)
+	{
+		const int begin = band * plateauBand * width;
+		const int end = std::min(height, (band + 1) * plateauBand) * width;
+		int count{0};
+		for(int p{begin}; p < end; ++p)
+		{
+			if(cells[p] != -1 && parents[p] == p)
+				count++;
+		}
+		bandOffsets[band + 1] = count;
+	}
+	for(int band{0}; band < bands; ++band)
+		bandOffsets[band + 1] += bandOffsets[band];
+
+	plateaus.resize(bandOffsets[bands]);
+	#pragma omp parallel for schedule(dynamic)
+	for(int band = 0; band < bands; ++band)
+	{
+		const int begin = band * plateauBand * width;
+		const int end = std::min(height, (band + 1) * plateauBand) * width;
+		int id{bandOffsets[band]};
+		for(int p{begin}; p < end; ++p)
+		{
+			if(cells[p] == -1)
+				labels[p] = -1;
+			else if(parents[p] == p)
+			{
+				labels[p] = id;
+				plateaus[id] = Plateau{p, cells[p], 0, false};
+				id++;
+			}
+		}
+	}
+
+	// every pixel takes the id of its root, parents are only read from now on
+	#pragma omp parallel for schedule(dynamic)
+	for(int band = 0; band < bands; ++band)
+	{
+		const int begin = band * plateauBand * width;
+		const int end = std::min(height, (band + 1) * plateauBand) * width;
+		int run{-1};
+		int runArea{0};
+		for(int p{begin}; p < end; ++p)
+		{
+			if(cells[p] == -1)
+				continue;
+
+			int root{p};
+			while(parents[root] != root)
+				root = parents[root];
+			if(root != p)
+				labels[p] = labels[root];
+
+			// areas are summed over runs of the same plateau
+			if(labels[p] != run)
+			{
+				if(run != -1)
+				{
+					#pragma omp atomic
+					plateaus[run].area += runArea;
+				}
+				run = labels[p];
+				runArea = 0;
+			}
+			runArea++;
+		}
+		if(run != -1)
+		{
+			#pragma omp atomic
+			plateaus[run].area += runArea;
+		}
+	}
+}
+
+template<int N, typename Level>
+int computeCellMarker(
+		const int width,
+		const int height,
+		const int* cellPixels,
+		const int pixelCount,
+		const GradientView<Level> gradient,
+		int* positions,
+		ComponentTree & tree)
+{
+	if(pixelCount == 0)
+		return -1;
+
+	// position of each pixel in the cell, cores do not overlap so cells of other threads write elsewhere
+	for(int i{0}; i < pixelCount; ++i)
+		positions[cellPixels[i] / 3] = i;
+
+	auto level = [&](const int i) -> int
+	{
+		return gradient[cellPixels[i] / 3];
+	};
+
+	// sort pixels by increasing gradient, counting 65536 levels would cost more than the cell itself
+	tree.order.resize(pixelCount);
+	if constexpr(sizeof(Level) == 1)
+	{
+		std::array<int, 257> histogram{};
+		for(int i{0}; i < pixelCount; ++i)
+			histogram[level(i) + 1]++;
+		for(int l{1}; l < 257; ++l)
+			histogram[l] += histogram[l-1];
+		for(int i{0}; i < pixelCount; ++i)
+			tree.order[histogram[level(i)]++] = i;
+	}
+	else
+	{
+		for(int i{0}; i < pixelCount; ++i)
+			tree.order[i] = i;
+		std::stable_sort(tree.order.begin(), tree.order.end(), [&](const int a, const int b) { return level(a) < level(b); });
+	}
+
+	// -1 marks pixels not reached yet
+	tree.parent.assign(pixelCount, -1);
+	tree.area.resize(pixelCount);
+	tree.minimum.resize(pixelCount);
+	tree.extinction.assign(pixelCount, 0);
+
+	auto find = [&tree](int i) -> int
+	{
+		while(tree.parent[i] != i)
+		{
+			tree.parent[i] = tree.parent[tree.parent[i]];
+			i = tree.parent[i];
+		}
+		return i;
+	};
+	// flood the cell from its lowest pixels, merging components as their pixels meet
+	for(int k{0}; k < pixelCount; ++k)
+	{
+		const int p = tree.order[k];
+		const int pixel = cellPixels[p] / 3;
+		const int x = pixel % width;
+		const int y = pixel / width;
+		tree.parent[p] = p;
+		tree.area[p] = 1;
+		tree.minimum[p] = p;
+
+		for(const Offset & offset : Neighbourhood<N>::offsets)
+		{
+			if(x + offset.dx < 0 || x + offset.dx >= width || y + offset.dy < 0 || y + offset.dy >= height)
+				continue;
+
+			// neighbour must be a pixel of the cell already reached
+			const int n = pixel + offset.dy * width + offset.dx;
+			const int q = positions[n];
+			if(q < 0 || q >= pixelCount || cellPixels[q] != 3 * n || tree.parent[q] == -1)
+				continue;
+
+			int a = find(p);
+			int b = find(q);
+			if(a == b)
+				continue;
+
+			// keep the larger component as root
+			if(tree.area[a] < tree.area[b] || (tree.area[a] == tree.area[b] && tree.minimum[a] > tree.minimum[b]))
+				std::swap(a, b);
+
+			// two minima meet, the smaller one dies with its area as extinction value,
+			// a component born at the current level is not a minimum and hands over nothing
+			const bool minimumA = level(tree.minimum[a]) < level(p);
+			const bool minimumB = level(tree.minimum[b]) < level(p);
+			if(minimumA && minimumB)
+				tree.extinction[tree.minimum[b]] = tree.area[b];
+			else if(minimumB)
+				tree.minimum[a] = tree.minimum[b];
+
+			tree.parent[b] = a;
+			tree.area[a] += tree.area[b];
+		}
+	}
+
+	// surviving minima take the area of their whole component
+	for(int i{0}; i < pixelCount; ++i)
+	{
+		if(tree.parent[i] == i)
+			tree.extinction[tree.minimum[i]] = tree.area[i];
+	}
+
+	int best{-1};
+	for(int i{0}; i < pixelCount; ++i)
+	{
+		if(tree.extinction[i] > 0 && (best == -1 || tree.extinction[i] > tree.extinction[best]))
+			best = i;
+	}
+	return best;
+}
+
+void Engine::computeRegularizedGradient(
+		const int width,
+		const int height,
+		const int step,
+		const float weight,
+		const unsigned char* markers,
+		const unsigned char* gradient,
+		unsigned char* distance,
+		unsigned char* dest)
+{
+	computeRegularizedGradientBatch(1, width, height, step, weight, markers, gradient, distance, dest);
+}
+
+void Engine::computeRegularizedGradientBatch(
+		const int count,
+		const int width,
+		const int height,
+		const int step,
+		const float weight,
+		const unsigned char* markers,
+		const unsigned char* gradient,
+		unsigned char* distance,
+		unsigned char* dest)
+{
+	cl::CommandQueue queue = program.getCommandQueue();
+
+	// prepare data, indices are relative to their own image
+	pool.reserve(width, height * count);
+	const int pixels{width * height};
+	const int nbElems{pixels * count * 3};
+
+	markersIndices.clear();
+	markersOffsets.clear();
+	markersOffsets.push_back(0);
+	for(int image{0}; image < count; ++image)
+	{
+		const unsigned char* imageMarkers{markers + image * pixels * 3};
+		for(int i{0}; i < pixels; ++i)
+		{
+			if(imageMarkers[i*3+1] == 255)
+				markersIndices.push_back(i);
+		}
+		markersOffsets.push_back(markersIndices.size());
+	}
+
+	// without marker the distance saturates everywhere
+	int markersCount = markersIndices.size();
+	if(markersCount == 0)
+	{
+		std::fill(distance, distance + nbElems, 255);
+		std::fill(dest, dest + nbElems, 255);
+		setResident(DEVICE_REGULARIZED_GRADIENT, nullptr);
+		setResident(DEVICE_PRECISE_REGULARIZED_GRADIENT, nullptr);
+		return;
+	}
+
+	// 16 bits levels of the gradient only exist on the device, when the gradient stage left them there,
+	// the 8 bits gradient is usually still there too
+	const bool precise{preciseGradient && isResident(DEVICE_PRECISE_GRADIENT, gradient)};
+	cl::Kernel regularizedGradientKernel = precise ? program.getPreciseRegularizedGradientKernel() : program.getRegularizedGradientKernel();
+	if(!precise)
+		upload(DEVICE_GRADIENT, gradient, nbElems * sizeof(unsigned char));
+
+	cl::Buffer & markersBuffer = pool.getIndices(INDICES_MARKERS, markersCount);
+	cl::Buffer & markersOffsetsBuffer = pool.getIndices(INDICES_MARKER_OFFSETS, count + 1);
+	cl::Buffer & distanceBuffer = pool.getDevice(DEVICE_DISTANCE);
+	cl::Buffer & regularizedBuffer = pool.getDevice(DEVICE_REGULARIZED_GRADIENT);
+	queue.enqueueWriteBuffer(markersBuffer, CL_FALSE, 0, markersCount * sizeof(int), markersIndices.data());
+	queue.enqueueWriteBuffer(markersOffsetsBuffer, CL_FALSE, 0, (count + 1) * sizeof(int), markersOffsets.data());
+
+	// set kernel parameters
+	regularizedGradientKernel.setArg(0, width);
+	regularizedGradientKernel.setArg(1, height);
+	regularizedGradientKernel.setArg(2, static_cast<float>(step));
+	regularizedGradientKernel.setArg(3, weight);
+	regularizedGradientKernel.setArg(4, markersBuffer);
+	regularizedGradientKernel.setArg(5, markersOffsetsBuffer);
+	regularizedGradientKernel.setArg(6, pool.getDevice(precise ? DEVICE_PRECISE_GRADIENT : DEVICE_GRADIENT));
+	regularizedGradientKernel.setArg(7, distanceBuffer);
+	regularizedGradientKernel.setArg(8, regularizedBuffer);
+	if(precise)
+		regularizedGradientKernel.setArg(9, pool.getDevice(DEVICE_PRECISE_REGULARIZED_GRADIENT));
+
+	// distance and regularization in one launch
+	queue.enqueueNDRangeKernel(
+			regularizedGradientKernel,
+			cl::NullRange,
+			program.getGlobalSize(TUNED_REGULARIZED_GRADIENT, width, height, count),
+			program.getLocalSize(TUNED_REGULARIZED_GRADIENT));
+
+	// get results back to host, the regularized gradient stays resident for the flooding,
+	// where the first image of a batch finds it at the same address; the flooding of the other ones
+	// could not tell their 16 bits levels apart, so a batch floods the 8 bits ones everywhere
+	queue.enqueueReadBuffer(distanceBuffer, CL_FALSE, 0, nbElems * sizeof(unsigned char), distance);
+	queue.enqueueReadBuffer(regularizedBuffer, CL_TRUE, 0, nbElems * sizeof(unsigned char), dest);
+	setResident(DEVICE_REGULARIZED_GRADIENT, dest);
+	setResident(DEVICE_PRECISE_REGULARIZED_GRADIENT, precise && count == 1 ? dest : nullptr);
+}
+
+// #####################
+// ##### WATERSHED #####
+// #####################
+
+void Engine::initBasins(
+		const int width,
+		const int height,
+		const HexagonGrid & grid,
+		const std::vector<int> & cellIds,
+		const int originX,
+		const int originY,
+		const unsigned char* markers)
+{
+	// seeds were selected along with the markers
+	if(markers == seededMarkers && cellIds.size() == seededCells)
+		return;
+
+	basinSeeds.clear();
+	basinCells.clear();
+
+	// a basin is seeded by the first marker pixel of its cell, cells without marker are skipped
+	for(int i{0}; i < cellIds.size(); ++i)
+	{
+		spans.clear();
+		grid.coreSpans(cellIds.at(i), originX, originY, width, height, spans);
+		int seed{-1};
+		for(int j{0}; j < spans.size() && seed == -1; ++j)
+		{
+			const Span & span = spans.at(j);
+			for(int x{span.begin}; x <= span.end; ++x)
+			{
+				if(markers[3 * (span.y * width + x) + 1] == 255)
+				{
+					seed = 3 * (span.y * width + x);
+					break;
+				}
+			}
+		}
+
+		if(seed != -1)
+		{
+			basinSeeds.push_back(seed);
+			basinCells.push_back(i);
+		}
+	}
+
+	// the seeds of computeCellMarkers are gone, a later call with its markers must not reuse these
+	seededMarkers = markers;
+	seededCells = cellIds.size();
+}
+
+void Engine::computeWatershed(
+		const int width,
+		const int height,
+		const HexagonGrid & grid,
+		const std::vector<int> & cellIds,
+		const int originX,
+		const int originY,
+		const unsigned char* markers,
+		const unsigned char* regularizedGradient,
+		int* labelsMap)
+{
+	pool.reserve(width, height);
+	initBasins(width, height, grid, cellIds, originX, originY, markers);
+
+	// flood the 16 bits levels when the regularization left them on the device
+	const bool precise{isResident(DEVICE_PRECISE_REGULARIZED_GRADIENT, regularizedGradient)};
+	if(deviceWatershed)
+	{
+		computeWatershedDevice(width, height, cellIds, regularizedGradient, precise, labelsMap);
+		return;
+	}
+
+	if(precise)
+	{
+		unsigned short* levels{pool.getPrecise()};
+		program.getCommandQueue().enqueueReadBuffer(pool.getDevice(DEVICE_PRECISE_REGULARIZED_GRADIENT), CL_TRUE, 0, width * height * sizeof(unsigned short), levels);
+		if(connectivity == CONNECTIVITY_4)
+			computeWatershedHost<4>(width, height, cellIds, GradientView<unsigned short>{levels}, labelsMap);
+		else
+			computeWatershedHost<8>(width, height, cellIds, GradientView<unsigned short>{levels}, labelsMap);
+	}
+	else if(connectivity == CONNECTIVITY_4)
+		computeWatershedHost<4>(width, height, cellIds, GradientView<unsigned char>{regularizedGradient}, labelsMap);
+	else
+		computeWatershedHost<8>(width, height, cellIds, GradientView<unsigned char>{regularizedGradient}, labelsMap);
+}
+
+void Engine::refineWatershed(
+		const int width,
+		const int height,
+		const HexagonGrid & grid,
+		const std::vector<int> & cellIds,
+		const int originX,
+		const int originY,
+		const unsigned char* markers,
+		const unsigned char* regularizedGradient,
+		const int radius,
+		int* labelsMap)
+{
+	pool.reserve(width, height);
+	initBasins(width, height, grid, cellIds, originX, originY, markers);
+
+	if(isResident(DEVICE_PRECISE_REGULARIZED_GRADIENT, regularizedGradient))
+	{
+		unsigned short* levels{pool.getPrecise()};
+		program.getCommandQueue().enqueueReadBuffer(pool.getDevice(DEVICE_PRECISE_REGULARIZED_GRADIENT), CL_TRUE, 0, width * height * sizeof(unsigned short), levels);
+		if(connectivity == CONNECTIVITY_4)
+			refineWatershedHost<4>(width, height, cellIds, GradientView<unsigned short>{levels}, radius, labelsMap);
+		else
+			refineWatershedHost<8>(width, height, cellIds, GradientView<unsigned short>{levels}, radius, labelsMap);
+	}
+	else if(connectivity == CONNECTIVITY_4)
+		refineWatershedHost<4>(width, height, cellIds, GradientView<unsigned char>{regularizedGradient}, radius, labelsMap);
+	else
+		refineWatershedHost<8>(width, height, cellIds, GradientView<unsigned char>{regularizedGradient}, radius, labelsMap);
+}
+
+void Engine::computeWatershedDevice(const int width, const int height, const std::vector<int> & cellIds, const unsigned char* regularizedGradient, const bool precise, int* labelsMap)
+{
+	cl::CommandQueue queue = program.getCommandQueue();
+	cl::Kernel seedKernel = program.getSeedKernel();
+	cl::Kernel propagationKernel = precise ? program.getPrecisePropagationKernel() : program.getPropagationKernel();
+	cl::Kernel labelsKernel = program.getWatershedLabelsKernel();
+
+	// prepare data, flooding keys ping-pong between the two scratch buffers
+	const int nbElems{width * height * 3};
+	cl::Buffer* flood{&pool.getDevice(DEVICE_PING)};
+	cl::Buffer* next{&pool.getDevice(DEVICE_PONG)};
+	cl::Buffer & labelsBuffer = pool.getDevice(DEVICE_LABELS);
+	cl::Buffer & changedBuffer = pool.getIndices(INDICES_CHANGED, 1);
+	if(!precise)
+		upload(DEVICE_REGULARIZED_GRADIENT, regularizedGradient, nbElems * sizeof(unsigned char));
+	queue.enqueueFillBuffer(*flood, std::numeric_limits<cl_ulong>::max(), 0, width * height * sizeof(cl_ulong));
+
+	// seed every basin with its label
+	seeds.clear();
+	for(int i{0}; i < basinSeeds.size(); ++i)
+	{
+		seeds.push_back(basinSeeds.at(i) / 3);
+		seeds.push_back(cellIds.at(basinCells.at(i)) + 1);
+	}
+	if(!seeds.empty())
+	{
+		cl::Buffer & seedsBuffer = pool.getIndices(INDICES_SEEDS, seeds.size());
+		queue.enqueueWriteBuffer(seedsBuffer, CL_FALSE, 0, seeds.size() * sizeof(int), seeds.data());
+
+		seedKernel.setArg(0, seedsBuffer);
+		seedKernel.setArg(1, *flood);
+		queue.enqueueNDRangeKernel(seedKernel, cl::NullRange, basinSeeds.size(), cl::NullRange);
+	}
+
+	// set propagation kernel parameters
+	propagationKernel.setArg(0, width);
+	propagationKernel.setArg(1, height);
+	propagationKernel.setArg(2, pool.getDevice(precise ? DEVICE_PRECISE_REGULARIZED_GRADIENT : DEVICE_REGULARIZED_GRADIENT));
+	propagationKernel.setArg(5, changedBuffer);
+	propagationKernel.setArg(6, static_cast<int>(connectivity));
+
+	// relax until no key decreases, only the last step of a batch is checked
+	int changed{1};
+	while(changed != 0)
+	{
+		if(isCancelled())
+		{
+			setResident(DEVICE_LABELS, nullptr);
+			return;
+		}
+
+		for(int i{0}; i < propagationBatch; ++i)
+		{
+			if(i == propagationBatch - 1)
+				queue.enqueueFillBuffer(changedBuffer, 0, 0, sizeof(int));
+
+			propagationKernel.setArg(3, *flood);
+			propagationKernel.setArg(4, *next);
+			queue.enqueueNDRangeKernel(propagationKernel, cl::NullRange, width * height, cl::NullRange);
+			std::swap(flood, next);
+		}
+		queue.enqueueReadBuffer(changedBuffer, CL_TRUE, 0, sizeof(int), &changed);
+	}
+
+	// set labels kernel parameters
+	labelsKernel.setArg(0, width);
+	labelsKernel.setArg(1, height);
+	labelsKernel.setArg(2, *flood);
+	labelsKernel.setArg(3, labelsBuffer);
+	labelsKernel.setArg(4, static_cast<int>(connectivity));
+
+	// launch kernel on the compute device
+	queue.enqueueNDRangeKernel(labelsKernel, cl::NullRange, width * height, cl::NullRange);
+
+	// get result back to host, the device copy stays resident for the contours
+	queue.enqueueReadBuffer(labelsBuffer, CL_TRUE, 0, width * height * sizeof(int), labelsMap);
+	setResident(DEVICE_LABELS, labelsMap);
+}
+
+template<int N, typename Level>
+void Engine::computeWatershedHost(const int width, const int height, const std::vector<int> & cellIds, const GradientView<Level> regularizedGradient, int* labelsMap)
+{
+	if(blockFlooding)
+	{
+		computeWatershedBlocks<N>(width, height, cellIds, regularizedGradient, labelsMap);
+		return;
+	}
+
+	const double start{omp_get_wtime()};
+	bool* inQueue{pool.getVisited()};
+	std::fill(inQueue, inQueue + width * height, false);
+	std::fill(labelsMap, labelsMap + width * height, 0);
+
+	// init labels map, the flooding starts around the seeds
+	frontier.clear();
+	for(int i{0}; i < basinSeeds.size(); ++i)
+	{
+		labelsMap[basinSeeds.at(i) / 3] = cellIds.at(basinCells.at(i)) + 1;
+		inQueue[basinSeeds.at(i) / 3] = true;
+		frontier.push_back(basinSeeds.at(i) / 3);
+	}
+
+	floodHost<N, Level>(RasterLayout{width, height}, regularizedGradient, labelsMap, inQueue);
+	floodSeconds = omp_get_wtime() - start;
+}
+
+template<int N, typename Level>
+void Engine::computeWatershedBlocks(const int width, const int height, const std::vector<int> & cellIds, const GradientView<Level> regularizedGradient, int* labelsMap)
+{
+	const double start{omp_get_wtime()};
+	const BlockLayout layout(width, height);
+	if(blockLevels.size() < layout.size())
+	{
+		blockLevels.resize(layout.size());
+		blockLabels.resize(layout.size());
+		blockQueued.resize(layout.size());
+	}
+	std::fill(blockLabels.begin(), blockLabels.begin() + layout.size(), 0);
+	std::fill(blockQueued.begin(), blockQueued.begin() + layout.size(), 0);
+
+	#pragma omp parallel for
+	for(int y = 0; y < height; ++y)
+	{
+		for(int x{0}; x < width; ++x)
+			blockLevels[layout.index(x, y)] = regularizedGradient[y * width + x];
+	}
+
+	// seeds in the same order as in raster layout, so plateaus are shared alike
+	frontier.clear();
+	for(int i{0}; i < basinSeeds.size(); ++i)
+	{
+		const int pixel = layout.index(basinSeeds.at(i) / 3 % width, basinSeeds.at(i) / 3 / width);
+		blockLabels[pixel] = cellIds.at(basinCells.at(i)) + 1;
+		blockQueued[pixel] = 1;
+		frontier.push_back(pixel);
+	}
+
+	floodHost<N, Level>(layout, blockLevels.data(), blockLabels.data(), blockQueued.data());
+
+	#pragma omp parallel for
+	for(int y = 0; y < height; ++y)
+	{
+		for(int x{0}; x < width; ++x)
+			labelsMap[y * width + x] = blockLabels[layout.index(x, y)];
+	}
+	floodSeconds = omp_get_wtime() - start;
+}
+
+template<int N, typename Level>
+void Engine::refineWatershedHost(const int width, const int height, const std::vector<int> & cellIds, const GradientView<Level> regularizedGradient, const int radius, int* labelsMap)
+{
+	const double start{omp_get_wtime()};
+	int* band{pool.getScratch(SCRATCH_CELLS)};
+	int* rows{pool.getScratch(SCRATCH_PARENTS)};
+
+	// watershed lines and pixels between two labels
+	#pragma omp parallel for
+	for(int y = 0; y < height; ++y)
+	{
+		for(int x{0}; x < width; ++x)
+		{
+			const int pixel = y * width + x;
+			bool line{labelsMap[pixel] == 0};
+			for(const Offset & offset : Neighbourhood<N>::offsets)
+			{
+				if(line)
+					break;
+				if(x + offset.dx < 0 || x + offset.dx >= width || y + offset.dy < 0 || y + offset.dy >= height)
+					continue;
+				line = labelsMap[pixel + offset.dy * width + offset.dx] != labelsMap[pixel];
+			}
+			band[pixel] = line;
+		}
+	}
+
+	// dilate them by radius along the rows, then along the columns
+	#pragma omp parallel for
+	for(int y = 0; y < height; ++y)
+	{
+		int* row{band + y * width};
+		int* dilated{rows + y * width};
+		int last{std::numeric_limits<int>::min() / 2};
+		for(int x{0}; x < width; ++x)
+		{
+			if(row[x])
+				last = x;
+			dilated[x] = x - last <= radius;
+		}
+		last = std::numeric_limits<int>::max() / 2;
+		for(int x{width - 1}; x >= 0; --x)
+		{
+			if(row[x])
+				last = x;
+			dilated[x] |= last - x <= radius;
+		}
+	}
+	#pragma omp parallel for
+	for(int y = 0; y < height; ++y)
+	{
+		int* row{band + y * width};
+		std::fill(row, row + width, 0);
+		for(int other{std::max(0, y - radius)}; other <= std::min(height - 1, y + radius); ++other)
+		{
+			const int* dilated{rows + other * width};
+			for(int x{0}; x < width; ++x)
+				row[x] |= dilated[x];
+		}
+	}
+
+	// the band is flooded again, the labels elsewhere are final, the labelled pixels along it are collected
+	// in the same pass; static rows go to the threads in order, so their lists join in raster order
+	bool* inQueue{pool.getVisited()};
+	if(threadFrontiers.size() < static_cast<std::size_t>(omp_get_max_threads()))
+		threadFrontiers.resize(omp_get_max_threads());
+	for(std::vector<int> & pixels : threadFrontiers)
+		pixels.clear();
+	#pragma omp parallel
+	{
+		std::vector<int> & along{threadFrontiers[omp_get_thread_num()]};
+		#pragma omp for schedule(static)
+		for(int y = 0; y < height; ++y)
+		{
+			for(int x{0}; x < width; ++x)
+			{
+				const int pixel = y * width + x;
+				inQueue[pixel] = !band[pixel];
+				if(band[pixel])
+				{
+					labelsMap[pixel] = 0;
+					continue;
+				}
+				for(const Offset & offset : Neighbourhood<N>::offsets)
+				{
+					if(x + offset.dx < 0 || x + offset.dx >= width || y + offset.dy < 0 || y + offset.dy >= height)
+						continue;
+					if(band[pixel + offset.dy * width + offset.dx])
+					{
+						along.push_back(pixel);
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	// the flooding starts around the seeds inside the band and from the labelled pixels along it
+	frontier.clear();
+	for(int i{0}; i < basinSeeds.size(); ++i)
+	{
+		const int pixel = basinSeeds.at(i) / 3;
+		if(!band[pixel])
+			continue;
+		labelsMap[pixel] = cellIds.at(basinCells.at(i)) + 1;
+		inQueue[pixel] = true;
+		frontier.push_back(pixel);
+	}
+	for(const std::vector<int> & along : threadFrontiers)
+		frontier.insert(frontier.end(), along.begin(), along.end());
+
+	floodHost<N, Level>(RasterLayout{width, height}, regularizedGradient, labelsMap, inQueue);
+	floodSeconds = omp_get_wtime() - start;
+}
+
+template<int N, typename Level, typename Layout, typename Levels, typename Flag>
+void Engine::floodHost(const Layout & layout, const Levels regularizedGradient, int* labelsMap, Flag* inQueue)
+{
+	// bucket queue, one FIFO per level, pixels below the level being flooded join it
+	constexpr int levels{1 << (8 * sizeof(Level))};
+	if(buckets.size() < levels)
+		buckets.resize(levels);
+	int current{0};
+	std::size_t queued{0};
+
+	// queue the neighbours not reached yet and return the label of the reached ones,
+	// 0 when they belong to different basins
+	auto visit = [&](const int pixel) -> int
+	{
+		const int x = layout.getX(pixel);
+		const int y = layout.getY(pixel);
+		int label{0};
+		bool agree{true};
+		for(const Offset & offset : Neighbourhood<N>::offsets)
+		{
+			if(x + offset.dx < 0 || x + offset.dx >= layout.width || y + offset.dy < 0 || y + offset.dy >= layout.height)
+				continue;
+
+			const int n = layout.neighbour(pixel, x, y, offset);
+			if(labelsMap[n] != 0)
+			{
+				if(label == 0)
+					label = labelsMap[n];
+				else if(labelsMap[n] != label)
+					agree = false;
+			}
+			else if(!inQueue[n])
+			{
+				inQueue[n] = true;
+				buckets[std::max<int>(regularizedGradient[n], current)].push_back(n);
+				queued++;
+			}
+		}
+		return agree ? label : 0;
+	};
+
+	for(const int pixel : frontier)
+		visit(pixel);
+
+	// flood
+	for(; current < levels && queued > 0 && !isCancelled(); ++current)
+	{
+		// the bucket grows while it is flooded
+		std::vector<int> & bucket = buckets[current];
+		for(std::size_t i{0}; i < bucket.size(); ++i)
+		{
+			labelsMap[bucket[i]] = visit(bucket[i]);
+			queued--;
+		}
+		bucket.clear();
+	}
+
+	// a cancelled flooding leaves pixels queued
+	for(; current < levels && queued > 0; ++current)
+	{
+		queued -= buckets[current].size();
+		buckets[current].clear();
+	}
+
+	// labels left on the device by a previous flooding are stale
+	setResident(DEVICE_LABELS, nullptr);
+}
+
+float Engine::computeContours(
+		const int width,
+		const int height,
+		const int* labelsMap,
+		const unsigned char* original,
+		const int originalStride,
+		unsigned char* contours,
+		unsigned char* result)
+{
+	float density{0};
+	computeContoursBatch(1, width, height, labelsMap, original, originalStride, contours, result, &density);
+	return density;
+}
+
+void Engine::computeContoursBatch(
+		const int count,
+		const int width,
+		const int height,
+		const int* labelsMap,
+		const unsigned char* original,
+		const int originalStride,
+		unsigned char* contours,
+		unsigned char* result,
+		float* densities)
+{
+	cl::CommandQueue queue = program.getCommandQueue();
+	cl::Kernel contoursKernel = program.getContoursKernel();
+
+	// prepare data, the labels map is usually still on the device
+	pool.reserve(width, height * count);
+	const int nbElems{width * height * count * 3};
+	cl::Buffer & originalImage = pool.getDevice(DEVICE_INPUT);
+	cl::Buffer & contoursImage = pool.getDevice(DEVICE_PING);
+	cl::Buffer & resultImage = pool.getDevice(DEVICE_PONG);
+	cl::Buffer & linesBuffer = pool.getIndices(INDICES_LINES, count);
+	upload(DEVICE_LABELS, labelsMap, width * height * count * sizeof(int));
+	const std::array<size_t, 3> origin{0, 0, 0};
+	const std::array<size_t, 3> region{static_cast<size_t>(width * 3), static_cast<size_t>(height * count), 1};
+	queue.enqueueWriteBufferRect(originalImage, CL_FALSE, origin, origin, region, width * 3, 0, originalStride, 0, original);
+	queue.enqueueFillBuffer(linesBuffer, 0, 0, count * sizeof(int));
+
+	// set kernel parameters
+	contoursKernel.setArg(0, width);
+	contoursKernel.setArg(1, height);
+	contoursKernel.setArg(2, pool.getDevice(DEVICE_LABELS));
+	contoursKernel.setArg(3, originalImage);
+	contoursKernel.setArg(4, contoursImage);
+	contoursKernel.setArg(5, resultImage);
+	contoursKernel.setArg(6, linesBuffer);
+
+	// launch on whole tiles of every image, pixels out of the image are skipped by the kernel
+	const int tile{CLProgram::contoursTileSize};
+	const cl::NDRange global((width + tile - 1) / tile * tile, (height + tile - 1) / tile * tile, count);
+	queue.enqueueNDRangeKernel(contoursKernel, cl::NullRange, global, cl::NDRange(tile, tile, 1));
+
+	// get results back to host
+	linePixels.resize(count);
+	queue.enqueueReadBuffer(contoursImage, CL_FALSE, 0, nbElems * sizeof(unsigned char), contours);
+	queue.enqueueReadBuffer(resultImage, CL_FALSE, 0, nbElems * sizeof(unsigned char), result);
+	queue.enqueueReadBuffer(linesBuffer, CL_TRUE, 0, count * sizeof(int), linePixels.data());
+
+	// contour density, image borders count as contours
+	for(int i{0}; i < count; ++i)
+	{
+		float contour_density{0};
+		contour_density += static_cast<float>(width * 2);
+		contour_density += static_cast<float>(height * 2);
+		contour_density += 4.0f;
+		contour_density += static_cast<float>(linePixels.at(i));
+		contour_density /= static_cast<float>(width * height);
+		densities[i] = contour_density;
+	}
+}
+
+// ##################
+// ##### REGION #####
+// ##################
+
+int Engine::getRegionHalo(const int step, const HexagonGrid & grid)
+{
+	// smoothing is two erosions and two dilations, the gradient reads one more pixel
+	const int radius = std::max(2, step / 16) / 2;
+	const int morphology = 4 * radius + 1;
+
+	// a cell crossing the region border is complete one hexagon away from it,
+	// the markers it competes with during the flooding lie one hexagon further
+	return 2 * grid.getHexagonWidth() + morphology;
+}
+
+void Engine::computeRegion(
+		const int width,
+		const int height,
+		const HexagonGrid & grid,
+		const int step,
+		const float weight,
+		const unsigned char* src,
+		const int srcStride,
+		const int left,
+		const int top,
+		const int regionWidth,
+		const int regionHeight,
+		int* labelsMap)
+{
+	// frame processed, the region and its halo clipped to the image
+	const int halo{getRegionHalo(step, grid)};
+	const int frameLeft{std::max(0, left - halo)};
+	const int frameTop{std::max(0, top - halo)};
+	const int w{std::min(width, left + regionWidth + halo) - frameLeft};
+	const int h{std::min(height, top + regionHeight + halo) - frameTop};
+
+	grid.coreCells(frameLeft, frameTop, frameLeft + w - 1, frameTop + h - 1, regionCells);
+
+	pool.reserve(w, h);
+	unsigned char* smoothRAW{pool.getHost(HOST_SMOOTH)};
+	unsigned char* gradientRAW{pool.getHost(HOST_GRADIENT)};
+	unsigned char* markersRAW{pool.getHost(HOST_MARKERS)};
+	unsigned char* distanceFromMarkersRAW{pool.getHost(HOST_DISTANCE)};
+	unsigned char* regularizedGradientRAW{pool.getHost(HOST_REGULARIZED_GRADIENT)};
+	int* frameLabels{pool.getLabels()};
+
+	// the frame is read in place from the image
+	computeSmooth(w, h, step, src + static_cast<std::size_t>(frameTop) * srcStride + frameLeft * 3, srcStride, smoothRAW);
+	computeLabGradient(w, h, smoothRAW, gradientRAW);
+	computeCellMarkers(w, h, grid, regionCells, frameLeft, frameTop, gradientRAW, markersRAW);
+	computeRegularizedGradient(w, h, step, weight, markersRAW, gradientRAW, distanceFromMarkersRAW, regularizedGradientRAW);
+	computeWatershed(w, h, grid, regionCells, frameLeft, frameTop, markersRAW, regularizedGradientRAW, frameLabels);
+
+	// only the region is returned, the halo was there for its borders
+	for(int y{0}; y < regionHeight; ++y)
+	{
+		const int* row{frameLabels + (top - frameTop + y) * w + (left - frameLeft)};
+		std::copy(row, row + regionWidth, labelsMap + static_cast<std::size_t>(y) * regionWidth);
+	}
+}
@@ -0,0 +1,65 @@
+#include "exporter.hpp"
+
+LayerExporter::LayerExporter(QObject* parent) :
+	QObject(parent),
+	format(EXPORT_PNG),
+	pending(0),
+	failures(0),
+	start(0.0)
+{
+}
+
+LayerExporter::~LayerExporter()
+{
+	pool.waitForDone();
+}
+
+void LayerExporter::setFormat(const ExportFormat value)
+{
+	format = value;
+}
+
+void LayerExporter::exportLayers(const QString & directory, const std::vector<ExportLayer> & layers)
+{
+	if(layers.empty())
+	{
+		emit finished(0, 0.0);
+		return;
+	}
+
+	start = omp_get_wtime();
+	failures = 0;
+	pending = static_cast<int>(layers.size());
+
+	const char* extension{format == EXPORT_PNG ? "png" : "ppm"};
+	for(const ExportLayer & layer : layers)
+	{
+		const QString path = directory + QString("/") + layer.name + QString(".") + QString(extension);
+		const QImage image = layer.image;
+		const int quality{format == EXPORT_PNG ? pngQuality : -1};
+		pool.start([this, path, image, extension, quality]()
+		{
+			const double begin = omp_get_wtime();
+			QImageWriter writer(path, extension);
+			writer.setQuality(quality);
+			const bool saved{writer.write(image)};
+			layerDone(path, saved, omp_get_wtime() - begin);
+		});
+	}
+}
+
+bool LayerExporter::isRunning() const
+{
+	return pending > 0;
+}
+
+void LayerExporter::layerDone(const QString & path, const bool saved, const double seconds)
+{
+	if(!saved)
+		failures++;
+	emit layerExported(path, saved, seconds);
+
+	// the last file written reports the whole export
+	if(--pending == 0)
+		emit finished(failures, omp_get_wtime() - start);
+}
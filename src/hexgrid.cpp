@@ -0,0 +1,194 @@
+#include "hexgrid.hpp"
+
+namespace
+{
+	int floorDiv(const int a, const int b)
+	{
+		return (a >= 0) ? a / b : -((-a + b - 1) / b);
+	}
+}
+
+HexagonGrid::HexagonGrid() :
+	hexWidth(0),
+	baseOffset(0),
+	slicesX(0),
+	slicesY(0),
+	halfWidth(0.0f),
+	halfSide(0.0f),
+	halfHeight(0.0f),
+	coreHalfHeight(0)
+{
+}
+
+HexagonGrid::HexagonGrid(const int width, const int height, const int step, const float rho) :
+	hexWidth(static_cast<int>(step + 2 * (cos(M_PI / 3.0) * step))),
+	baseOffset(hexWidth / 2 + hexWidth / 4),
+	slicesX(0),
+	slicesY(0),
+	halfWidth(static_cast<float>(hexWidth / 2)),
+	halfSide(static_cast<float>(hexWidth / 4)),
+	halfHeight(static_cast<float>(hexWidth / 2)),
+	coreHalfHeight(0)
+{
+	if(hexWidth < 2)
+		return;
+
+	slicesX = width / (hexWidth / 2);
+	slicesY = height / (hexWidth / 2);
+
+	// core vertices are rounded to pixels, as the polygon drawn by the former grid was
+	const int coreHalfWidth = static_cast<int>(std::lround(rho * (hexWidth / 2)));
+	const int coreHalfSide = static_cast<int>(std::lround(rho * (hexWidth / 4)));
+	coreHalfHeight = static_cast<int>(std::lround(rho * (hexWidth / 2)));
+
+	coreRows.resize(2 * coreHalfHeight + 1);
+	for(int dy{-coreHalfHeight}; dy <= coreHalfHeight; ++dy)
+	{
+		float half = static_cast<float>(coreHalfWidth);
+		if(coreHalfHeight > 0)
+			half -= static_cast<float>(coreHalfWidth - coreHalfSide) * std::abs(dy) / coreHalfHeight;
+		coreRows[dy + coreHalfHeight] = static_cast<int>(std::floor(half));
+	}
+}
+
+int HexagonGrid::getHexagonWidth() const
+{
+	return hexWidth;
+}
+
+int HexagonGrid::getBaseOffset() const
+{
+	return baseOffset;
+}
+
+int HexagonGrid::getSlicesX() const
+{
+	return slicesX;
+}
+
+int HexagonGrid::getSlicesY() const
+{
+	return slicesY;
+}
+
+int HexagonGrid::getCellCount() const
+{
+	return slicesX * slicesY;
+}
+
+void HexagonGrid::center(const int cell, int & x, int & y) const
+{
+	const int column = cell % slicesX;
+	const int row = cell / slicesX;
+	x = column * baseOffset;
+	y = row * hexWidth + ((column % 2 != 0) ? hexWidth / 2 : 0);
+}
+
+float HexagonGrid::norm(const int dx, const int dy) const
+{
+	// smallest scale of the outer hexagon holding the offset
+	const float vertical = std::abs(dy) / halfHeight;
+	return std::max(vertical, (std::abs(dx) + (halfWidth - halfSide) * vertical) / halfWidth);
+}
+
+int HexagonGrid::cellAt(const int x, const int y) const
+{
+	if(slicesX == 0 || slicesY == 0)
+		return -1;
+
+	// the hexagon holding the pixel is centered in one of the two surrounding columns,
+	// in one of the two surrounding rows of that column
+	const int column = floorDiv(x, baseOffset);
+	int bestX{-1};
+	int bestY{-1};
+	float bestNorm{0.0f};
+	for(int cx{column}; cx <= column + 1; ++cx)
+	{
+		const int shift = (cx % 2 != 0) ? hexWidth / 2 : 0;
+		const int row = floorDiv(y - shift, hexWidth);
+		for(int cy{row}; cy <= row + 1; ++cy)
+		{
+			const float n = norm(x - cx * baseOffset, y - (cy * hexWidth + shift));
+			if(bestX == -1 || n < bestNorm)
+			{
+				bestNorm = n;
+				bestX = cx;
+				bestY = cy;
+			}
+		}
+	}
+
+	if(bestX < 0 || bestX >= slicesX || bestY < 0 || bestY >= slicesY)
+		return -1;
+	return bestY * slicesX + bestX;
+}
+
+bool HexagonGrid::inCore(const int cell, const int x, const int y) const
+{
+	int cx;
+	int cy;
+	center(cell, cx, cy);
+
+	const int dy = y - cy;
+	if(dy < -coreHalfHeight || dy > coreHalfHeight)
+		return false;
+	return std::abs(x - cx) <= coreRows[dy + coreHalfHeight];
+}
+
+void HexagonGrid::coreSpans(const int cell, const int originX, const int originY, const int width, const int height, std::vector<Span> & spans) const
+{
+	int cx;
+	int cy;
+	center(cell, cx, cy);
+
+	for(int dy{-coreHalfHeight}; dy <= coreHalfHeight; ++dy)
+	{
+		const int y = cy + dy - originY;
+		if(y < 0 || y >= height)
+			continue;
+
+		const int half = coreRows[dy + coreHalfHeight];
+		const int begin = std::max(0, cx - half - originX);
+		const int end = std::min(width - 1, cx + half - originX);
+		if(begin <= end)
+			spans.push_back(Span{y, begin, end});
+	}
+}
+
+void HexagonGrid::coreBounds(const int cell, int & left, int & top, int & right, int & bottom) const
+{
+	int cx;
+	int cy;
+	center(cell, cx, cy);
+
+	left = cx - coreRows[coreHalfHeight];
+	right = cx + coreRows[coreHalfHeight];
+	top = cy - coreHalfHeight;
+	bottom = cy + coreHalfHeight;
+}
+
+void HexagonGrid::coreCells(const int left, const int top, const int right, const int bottom, std::vector<int> & cellIds) const
+{
+	cellIds.clear();
+
+	const int firstX = std::max(0, (left - hexWidth / 2) / baseOffset);
+	const int lastX = std::min(slicesX - 1, (right + hexWidth / 2) / baseOffset + 1);
+	const int firstY = std::max(0, (top - hexWidth) / hexWidth);
+	const int lastY = std::min(slicesY - 1, (bottom + hexWidth) / hexWidth + 1);
+
+	int coreLeft;
+	int coreTop;
+	int coreRight;
+	int coreBottom;
+	for(int y{firstY}; y <= lastY; ++y)
+	{
+		for(int x{firstX}; x <= lastX; ++x)
+		{
+			const int cell = y * slicesX + x;
+			coreBounds(cell, coreLeft, coreTop, coreRight, coreBottom);
+			if(coreRight < left || coreLeft > right || coreBottom < top || coreTop > bottom)
+				continue;
+			cellIds.push_back(cell);
+		}
+	}
+}
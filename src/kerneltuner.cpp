@@ -0,0 +1,273 @@
+#include "kerneltuner.hpp"
+
+std::mutex KernelTuner::processLock;
+std::unordered_map<std::string, KernelTuner::Shapes> KernelTuner::processShapes;
+
+KernelTuner::KernelTuner(CLProgram & program, const std::string & source) :
+	program(program)
+{
+	std::ostringstream key;
+	key << program.getDevice().getInfo<CL_DEVICE_NAME>() << " / " << program.getDevice().getInfo<CL_DRIVER_VERSION>()
+		<< " / " << std::hex << std::hash<std::string>{}(source);
+	deviceKey = key.str();
+
+	// the key is the first field of a tab separated line
+	for(char & c : deviceKey)
+	{
+		if(c == '\t' || c == '\n' || c == '\0')
+			c = ' ';
+	}
+
+	// info strings may carry their terminating null
+	for(int k{0}; k < TUNED_KERNELS; ++k)
+	{
+		std::string name{program.getTunedKernel(static_cast<TunedKernel>(k)).getInfo<CL_KERNEL_FUNCTION_NAME>()};
+		name.erase(std::find(name.begin(), name.end(), '\0'), name.end());
+		kernelNames[k] = name;
+	}
+}
+
+std::string KernelTuner::getCachePath()
+{
+	const char* configured{std::getenv("WATERPIXELS_TUNING_CACHE")};
+	if(configured != nullptr)
+		return configured;
+
+	std::filesystem::path directory;
+	if(const char* xdg{std::getenv("XDG_CACHE_HOME")}; xdg != nullptr && *xdg != '\0')
+		directory = xdg;
+	else if(const char* home{std::getenv("HOME")}; home != nullptr && *home != '\0')
+		directory = std::filesystem::path(home) / ".cache";
+	else if(const char* local{std::getenv("LOCALAPPDATA")}; local != nullptr && *local != '\0')
+		directory = local;
+	else
+		return std::string();
+	return (directory / "waterpixels" / "workgroups").string();
+}
+
+void KernelTuner::apply()
+{
+	std::lock_guard<std::mutex> lock(processLock);
+	const auto known = processShapes.find(deviceKey);
+	if(known != processShapes.end())
+	{
+		for(int k{0}; k < TUNED_KERNELS; ++k)
+			program.setLocalSize(static_cast<TunedKernel>(k), known->second[k][0], known->second[k][1]);
+		return;
+	}
+
+	const std::string path{getCachePath()};
+	if(path.empty() || !load(path))
+	{
+		if(program.isVerbose())
+			std::cout << "Tuning work-groups for this device..." << std::endl;
+		tune();
+		if(!path.empty())
+			save(path);
+	}
+	processShapes[deviceKey] = getShapes();
+}
+
+KernelTuner::Shapes KernelTuner::getShapes() const
+{
+	Shapes shapes;
+	for(int k{0}; k < TUNED_KERNELS; ++k)
+	{
+		const cl::NDRange local{program.getLocalSize(static_cast<TunedKernel>(k))};
+		shapes[k][0] = local.dimensions() == 0 ? 0 : static_cast<int>(local.get()[0]);
+		shapes[k][1] = local.dimensions() == 0 ? 0 : static_cast<int>(local.get()[1]);
+	}
+	return shapes;
+}
+
+bool KernelTuner::load(const std::string & path)
+{
+	std::ifstream stream(path);
+	if(!stream)
+		return false;
+
+	std::array<bool, TUNED_KERNELS> found{};
+	std::string line;
+	while(std::getline(stream, line))
+	{
+		std::istringstream fields(line);
+		std::string key;
+		std::string name;
+		int x{0};
+		int y{0};
+		if(!std::getline(fields, key, '\t') || key != deviceKey || !std::getline(fields, name, '\t') || !(fields >> x >> y))
+			continue;
+
+		for(int k{0}; k < TUNED_KERNELS; ++k)
+		{
+			if(name == kernelNames[k])
+			{
+				program.setLocalSize(static_cast<TunedKernel>(k), x, y);
+				found[k] = true;
+			}
+		}
+	}
+	return std::all_of(found.begin(), found.end(), [](const bool f) { return f; });
+}
+
+void KernelTuner::save(const std::string & path) const
+{
+	// lines of the other devices are kept
+	std::vector<std::string> lines;
+	{
+		std::ifstream stream(path);
+		std::string line;
+		while(std::getline(stream, line))
+		{
+			if(line.compare(0, deviceKey.size() + 1, deviceKey + "\t") != 0)
+				lines.push_back(line);
+		}
+	}
+
+	const Shapes shapes{getShapes()};
+	for(int k{0}; k < TUNED_KERNELS; ++k)
+		lines.push_back(deviceKey + "\t" + kernelNames[k] + "\t" + std::to_string(shapes[k][0]) + " " + std::to_string(shapes[k][1]));
+
+	// written aside then renamed, so processes starting together never read half a file;
+	// each writer has its own temporary file, so none renames the file another one is still writing
+	std::error_code error;
+	const std::filesystem::path target(path);
+	if(target.has_parent_path())
+		std::filesystem::create_directories(target.parent_path(), error);
+	std::ostringstream suffix;
+	suffix << "." << std::hex << std::random_device{}() << "." << std::hash<std::thread::id>{}(std::this_thread::get_id()) << ".tmp";
+	const std::filesystem::path temporary(path + suffix.str());
+	std::ofstream stream(temporary, std::ofstream::trunc);
+	for(const std::string & line : lines)
+		stream << line << '\n';
+	stream.close();
+	if(!stream.fail())
+		std::filesystem::rename(temporary, target, error);
+	if(stream.fail() || error)
+	{
+		std::filesystem::remove(temporary, error);
+		std::cerr << "Work-group tuning could not be saved to " << path << std::endl;
+	}
+}
+
+void KernelTuner::tune()
+{
+	cl::Context & context = program.getContext();
+
+	// noise, so no branch of the kernels is favoured, and markers on a regular grid
+	const int pixels{benchmarkSize * benchmarkSize};
+	std::vector<unsigned char> image(pixels * 3);
+	std::minstd_rand random{1};
+	for(unsigned char & value : image)
+		value = static_cast<unsigned char>(random() & 0xff);
+	std::vector<int> markers;
+	for(int y{benchmarkStep / 2}; y < benchmarkSize; y += benchmarkStep)
+	{
+		for(int x{benchmarkStep / 2}; x < benchmarkSize; x += benchmarkStep)
+			markers.push_back(y * benchmarkSize + x);
+	}
+	std::array<int, 2> markersOffsets{0, static_cast<int>(markers.size())};
+
+	cl::Buffer input(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, image.size(), image.data());
+	cl::Buffer output(context, CL_MEM_READ_WRITE, image.size());
+	cl::Buffer distance(context, CL_MEM_READ_WRITE, image.size());
+	cl::Buffer markersBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, markers.size() * sizeof(int), markers.data());
+	cl::Buffer offsetsBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, markersOffsets.size() * sizeof(int), markersOffsets.data());
+
+	// arguments as the engine sets them, it sets them again before each of its launches
+	for(const TunedKernel morphology : {TUNED_ERODE, TUNED_DILATION})
+	{
+		cl::Kernel & kernel = program.getTunedKernel(morphology);
+		kernel.setArg(0, benchmarkStep);
+		kernel.setArg(1, benchmarkSize);
+		kernel.setArg(2, benchmarkSize);
+		kernel.setArg(3, input);
+		kernel.setArg(4, output);
+		kernel.setArg(5, 0);
+	}
+
+	cl::Kernel & gradientKernel = program.getTunedKernel(TUNED_GRADIENT);
+	gradientKernel.setArg(0, benchmarkSize);
+	gradientKernel.setArg(1, benchmarkSize);
+	gradientKernel.setArg(2, input);
+	gradientKernel.setArg(3, output);
+
+	cl::Kernel & regularizedGradientKernel = program.getTunedKernel(TUNED_REGULARIZED_GRADIENT);
+	regularizedGradientKernel.setArg(0, benchmarkSize);
+	regularizedGradientKernel.setArg(1, benchmarkSize);
+	regularizedGradientKernel.setArg(2, static_cast<float>(benchmarkStep));
+	regularizedGradientKernel.setArg(3, 64.0f);
+	regularizedGradientKernel.setArg(4, markersBuffer);
+	regularizedGradientKernel.setArg(5, offsetsBuffer);
+	regularizedGradientKernel.setArg(6, input);
+	regularizedGradientKernel.setArg(7, distance);
+	regularizedGradientKernel.setArg(8, output);
+
+	for(int k{0}; k < TUNED_KERNELS; ++k)
+	{
+		const TunedKernel kernel{static_cast<TunedKernel>(k)};
+		double best{std::numeric_limits<double>::max()};
+		std::array<int, 2> winner{0, 0};
+		for(const std::array<int, 2> & candidate : getCandidates(kernel))
+		{
+			program.setLocalSize(kernel, candidate[0], candidate[1]);
+			const double seconds{measure(kernel)};
+			if(seconds < best)
+			{
+				best = seconds;
+				winner = candidate;
+			}
+		}
+		program.setLocalSize(kernel, winner[0], winner[1]);
+	}
+}
+
+double KernelTuner::measure(const TunedKernel kernel)
+{
+	cl::CommandQueue & queue = program.getCommandQueue();
+	const cl::NDRange global{program.getGlobalSize(kernel, benchmarkSize, benchmarkSize, 1)};
+	const cl::NDRange local{program.getLocalSize(kernel)};
+
+	try
+	{
+		// the first launch pays for the lazy setup of the driver
+		queue.enqueueNDRangeKernel(program.getTunedKernel(kernel), cl::NullRange, global, local);
+		queue.finish();
+
+		const auto start = std::chrono::steady_clock::now();
+		for(int i{0}; i < benchmarkRuns; ++i)
+			queue.enqueueNDRangeKernel(program.getTunedKernel(kernel), cl::NullRange, global, local);
+		queue.finish();
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	catch(const cl::Error &)
+	{
+		// shape refused for this kernel, usually too many registers for that many work-items
+		return std::numeric_limits<double>::max();
+	}
+}
+
+std::vector<std::array<int, 2>> KernelTuner::getCandidates(const TunedKernel kernel)
+{
+	const cl::Device & device = program.getDevice();
+	std::size_t maxGroupSize{program.getTunedKernel(kernel).getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device)};
+	// the 16 bits variants are launched with the same shape
+	if(kernel == TUNED_GRADIENT)
+		maxGroupSize = std::min(maxGroupSize, program.getPreciseGradientKernel().getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+	else if(kernel == TUNED_REGULARIZED_GRADIENT)
+		maxGroupSize = std::min(maxGroupSize, program.getPreciseRegularizedGradientKernel().getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+	const std::vector<std::size_t> maxItems{device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>()};
+
+	// the driver choice first, a tie keeps it
+	std::vector<std::array<int, 2>> candidates{{0, 0}};
+	for(int x{8}; x <= 256; x *= 2)
+	{
+		for(int y{1}; y <= 32; y *= 2)
+		{
+			const std::size_t size{static_cast<std::size_t>(x * y)};
+			if(size >= minGroupSize && size <= maxGroupSize && static_cast<std::size_t>(x) <= maxItems.at(0) && static_cast<std::size_t>(y) <= maxItems.at(1))
+				candidates.push_back({x, y});
+		}
+	}
+	return candidates;
+}
@@ -0,0 +1,147 @@
+#include "layeritem.hpp"
+
+LayerItem::LayerItem(const int width, const int height, const LayerFormat format) :
+	QGraphicsItem(),
+	width(width),
+	height(height),
+	format(format),
+	source(nullptr),
+	sourceWidth(0),
+	sourceHeight(0),
+	sourceStride(0),
+	frozen(false)
+{
+	for(int level{0}; level < 256; ++level)
+		lut[level] = qRgb(level, level, level);
+
+	// exposed rect is needed to render only the visible tiles
+	setFlag(QGraphicsItem::ItemUsesExtendedStyleOption);
+}
+
+void LayerItem::setSource(const unsigned char* data, const int sourceWidth, const int sourceHeight, const int stride)
+{
+	source = data;
+	this->sourceWidth = sourceWidth;
+	this->sourceHeight = sourceHeight;
+	sourceStride = stride;
+	invalidate();
+}
+
+void LayerItem::setLut(const std::array<QRgb, 256> & value)
+{
+	lut = value;
+	invalidate();
+}
+
+void LayerItem::invalidate()
+{
+	cache.clear();
+	ages.clear();
+	update();
+}
+
+void LayerItem::setFrozen(const bool value)
+{
+	frozen = value;
+	if(!frozen)
+		update();
+}
+
+QRectF LayerItem::boundingRect() const
+{
+	return QRectF(0, 0, width, height);
+}
+
+void LayerItem::paint(QPainter* painter, const QStyleOptionGraphicsItem* option, QWidget* widget)
+{
+	if(source == nullptr)
+		return;
+
+	// coarsest level still showing every screen pixel
+	const qreal detail{QStyleOptionGraphicsItem::levelOfDetailFromTransform(painter->worldTransform())};
+	int level{0};
+	while(level < maxLevel && (1 << (level + 1)) <= 1.0 / detail)
+		level++;
+
+	const int span{tileSize << level};
+	const QRectF exposed{option->exposedRect.intersected(boundingRect())};
+	const int left{static_cast<int>(std::floor(exposed.left())) / span};
+	const int top{static_cast<int>(std::floor(exposed.top())) / span};
+	const int right{std::min(static_cast<int>(std::ceil(exposed.right())), width - 1) / span};
+	const int bottom{std::min(static_cast<int>(std::ceil(exposed.bottom())), height - 1) / span};
+
+	for(int tileY{top}; tileY <= bottom; ++tileY)
+	{
+		for(int tileX{left}; tileX <= right; ++tileX)
+		{
+			const QPixmap* pixmap{tile(level, tileX, tileY)};
+			if(pixmap == nullptr)
+				continue;
+
+			const QRectF target(tileX * span, tileY * span, pixmap->width() << level, pixmap->height() << level);
+			painter->drawPixmap(target, *pixmap, QRectF(pixmap->rect()));
+		}
+	}
+}
+
+const QPixmap* LayerItem::tile(const int level, const int tileX, const int tileY)
+{
+	const std::uint64_t key{(static_cast<std::uint64_t>(level) << 48) | (static_cast<std::uint64_t>(tileY) << 24) | static_cast<std::uint64_t>(tileX)};
+	auto cached = cache.find(key);
+	if(cached != cache.end())
+	{
+		ages.splice(ages.begin(), ages, cached->second.age);
+		return &cached->second.pixmap;
+	}
+	if(frozen)
+		return nullptr;
+
+	// evict the least recently drawn tile
+	if(cache.size() >= cacheTiles)
+	{
+		cache.erase(ages.back());
+		ages.pop_back();
+	}
+	ages.push_front(key);
+	CachedTile & entry = cache[key];
+	entry.pixmap = render(level, tileX, tileY);
+	entry.age = ages.begin();
+	return &entry.pixmap;
+}
+
+QPixmap LayerItem::render(const int level, const int tileX, const int tileY) const
+{
+	const int originX{tileX * (tileSize << level)};
+	const int originY{tileY * (tileSize << level)};
+	const int tileWidth{std::min(tileSize, ((width - originX) + (1 << level) - 1) >> level)};
+	const int tileHeight{std::min(tileSize, ((height - originY) + (1 << level) - 1) >> level)};
+
+	QImage image(tileWidth, tileHeight, format == LAYER_RGB_KEYED ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+	unsigned char* bits{image.bits()};
+	const int bytesPerLine{image.bytesPerLine()};
+	for(int y{0}; y < tileHeight; ++y)
+	{
+		// nearest source pixel of the item pixel, the source may be smaller than the item
+		const int itemY{originY + (y << level)};
+		const unsigned char* row{source + static_cast<std::int64_t>(itemY) * sourceHeight / height * sourceStride};
+		QRgb* line = reinterpret_cast<QRgb*>(bits + y * bytesPerLine);
+		for(int x{0}; x < tileWidth; ++x)
+		{
+			const int itemX{originX + (x << level)};
+			const unsigned char* pixel{row + 3 * (static_cast<std::int64_t>(itemX) * sourceWidth / width)};
+			switch(format)
+			{
+				case LAYER_RGB:
+					line[x] = qRgb(pixel[0], pixel[1], pixel[2]);
+					break;
+				case LAYER_RGB_KEYED:
+					line[x] = (pixel[0] == 0 && pixel[1] == 0 && pixel[2] == 0) ? qRgba(0, 0, 0, 0) : qRgba(pixel[0], pixel[1], pixel[2], 255);
+					break;
+				case LAYER_LUT:
+					line[x] = lut[pixel[0]];
+					break;
+			}
+		}
+	}
+	return QPixmap::fromImage(image);
+}
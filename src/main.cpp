@@ -1,11 +1,67 @@
 #include "window.hpp"
+#include "tiling.hpp"
+#ifdef WATERPIXELS_SERVE
+#include "server.hpp"
+#endif
 
 int main(int argc, char* argv[])
 {
+	// headless tiled processing of large images
+	if(argc > 1 && std::string(argv[1]) == "--tiled")
+	{
+		if(argc < 5)
+		{
+			std::cerr << "Usage : " << argv[0] << " --tiled <image> <grid step> <labels output> [tile size]" << std::endl;
+			return -1;
+		}
+		QCoreApplication app(argc, argv);
+
+		try
+		{
+			CLProgram program("../clkernel/waterpixels.cl", true);
+			Engine engine(program);
+			TiledSegmentation tiled(engine);
+
+			const int step = std::atoi(argv[3]);
+			const int tileSize = (argc > 5) ? std::atoi(argv[5]) : 2048;
+			return tiled.run(argv[2], argv[4], step, tileSize) ? 0 : -1;
+		}
+		catch(const std::exception & exception)
+		{
+			std::cerr << exception.what() << std::endl;
+			return -1;
+		}
+	}
+
+#ifdef WATERPIXELS_SERVE
+	// long-lived segmentation service, programs stay compiled between requests
+	if(argc > 1 && std::string(argv[1]) == "--serve")
+	{
+		if(argc < 3)
+		{
+			std::cerr << "Usage : " << argv[0] << " --serve <socket path> [workers]" << std::endl;
+			return -1;
+		}
+		QCoreApplication app(argc, argv);
+
+		const int workers = (argc > 3) ? std::atoi(argv[3]) : 1;
+		SegmentationServer server("../clkernel/waterpixels.cl", workers);
+		return server.run(argv[2]) ? 0 : -1;
+	}
+#endif
+
 	QApplication app(argc, argv);
 
-	Window client;
-	client.show();
+	try
+	{
+		Window client;
+		client.show();
 
-	return app.exec();
+		return app.exec();
+	}
+	catch(const std::exception & exception)
+	{
+		std::cerr << exception.what() << std::endl;
+		return -1;
+	}
 }
@@ -0,0 +1,142 @@
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <numeric>
+#include <tuple>
+#include <engine.hpp>
+
+namespace py = pybind11;
+
+/**
+ *	Engine with its own compiled program, for evaluation scripts and data loaders.
+ *	Images are read in place through the buffer protocol, labels and contours are written straight
+ *	into arrays owned by Python, the buffer pool may be reallocated by any later call.
+ */
+class PythonSegmenter
+{
+	public:
+
+		/**
+		 *	hostWatershed and blockFlooding as in waterpixels_threading
+		 */
+		PythonSegmenter(const std::string & kernelFile, const bool hostWatershed, const bool blockFlooding);
+		/**
+		 *	image is a height * width * 3 uint8 buffer, rows may be padded but pixels must be packed;
+		 *	region is None or (x, y, width, height), whose labels are then returned in a new array
+		 */
+		py::object segment(py::buffer image, const int step, const float weight, const float rho, const bool contours, py::object region);
+		double getFloodSeconds();
+
+	private:
+
+		CLProgram program;
+		Engine engine;
+		std::vector<int> cellIds;
+		// the GIL is released while segmenting, calls from several threads are serialized here
+		std::mutex running;
+};
+
+PythonSegmenter::PythonSegmenter(const std::string & kernelFile, const bool hostWatershed, const bool blockFlooding) :
+	program(kernelFile),
+	engine(program)
+{
+	engine.setDeviceWatershed(!hostWatershed);
+	engine.setBlockFlooding(blockFlooding);
+}
+
+double PythonSegmenter::getFloodSeconds()
+{
+	std::lock_guard<std::mutex> lock(running);
+	return engine.getFloodSeconds();
+}
+
+py::object PythonSegmenter::segment(py::buffer image, const int step, const float weight, const float rho, const bool contours, py::object region)
+{
+	const py::buffer_info info = image.request();
+	if(info.ndim != 3 || info.shape[2] != 3 || info.itemsize != 1 || info.format != py::format_descriptor<unsigned char>::format())
+		throw py::value_error("image must be a height x width x 3 uint8 array");
+	if(info.strides[2] != 1 || info.strides[1] != 3 || info.strides[0] < 3 * info.shape[1])
+		throw py::value_error("image pixels must be packed RGB triplets, only rows may be padded");
+
+	const int width{static_cast<int>(info.shape[1])};
+	const int height{static_cast<int>(info.shape[0])};
+	const HexagonGrid grid(width, height, step, rho);
+	if(grid.getCellCount() == 0)
+		throw py::value_error("grid step is too small or too large for this image");
+
+	const unsigned char* original{static_cast<const unsigned char*>(info.ptr)};
+	const int originalStride{static_cast<int>(info.strides[0])};
+
+	// only the region and its halo are processed
+	if(!region.is_none())
+	{
+		const auto [x, y, regionWidth, regionHeight] = region.cast<std::tuple<int, int, int, int>>();
+		if(contours)
+			throw py::value_error("contours are not computed for a region");
+		if(x < 0 || y < 0 || regionWidth <= 0 || regionHeight <= 0 || x + regionWidth > width || y + regionHeight > height)
+			throw py::value_error("region must be (x, y, width, height) inside the image");
+
+		py::array_t<int> labels({static_cast<py::ssize_t>(regionHeight), static_cast<py::ssize_t>(regionWidth)});
+		int* labelsMap{labels.mutable_data()};
+		{
+			py::gil_scoped_release release;
+			std::lock_guard<std::mutex> lock(running);
+			engine.computeRegion(width, height, grid, step, weight, original, originalStride, x, y, regionWidth, regionHeight, labelsMap);
+		}
+		return labels;
+	}
+
+	// arrays are allocated while the GIL is held, then filled without it
+	py::array_t<int> labels({static_cast<py::ssize_t>(height), static_cast<py::ssize_t>(width)});
+	py::array_t<unsigned char> lines;
+	if(contours)
+		lines = py::array_t<unsigned char>({static_cast<py::ssize_t>(height), static_cast<py::ssize_t>(width), static_cast<py::ssize_t>(3)});
+	int* labelsMap{labels.mutable_data()};
+	unsigned char* linesRAW{contours ? lines.mutable_data() : nullptr};
+	{
+		py::gil_scoped_release release;
+		std::lock_guard<std::mutex> lock(running);
+
+		cellIds.resize(grid.getCellCount());
+		std::iota(cellIds.begin(), cellIds.end(), 0);
+
+		BufferPool & pool = engine.getPool();
+		pool.reserve(width, height);
+		unsigned char* smoothRAW{pool.getHost(HOST_SMOOTH)};
+		unsigned char* gradientRAW{pool.getHost(HOST_GRADIENT)};
+		unsigned char* markersRAW{pool.getHost(HOST_MARKERS)};
+		unsigned char* distanceFromMarkersRAW{pool.getHost(HOST_DISTANCE)};
+		unsigned char* regularizedGradientRAW{pool.getHost(HOST_REGULARIZED_GRADIENT)};
+
+		engine.computeSmooth(width, height, step, original, originalStride, smoothRAW);
+		engine.computeLabGradient(width, height, smoothRAW, gradientRAW);
+		engine.computeCellMarkers(width, height, grid, cellIds, 0, 0, gradientRAW, markersRAW);
+		engine.computeRegularizedGradient(width, height, step, weight, markersRAW, gradientRAW, distanceFromMarkersRAW, regularizedGradientRAW);
+		engine.computeWatershed(width, height, grid, cellIds, 0, 0, markersRAW, regularizedGradientRAW, labelsMap);
+		if(contours)
+			engine.computeContours(width, height, labelsMap, original, originalStride, linesRAW, pool.getHost(HOST_RESULT));
+	}
+
+	if(!contours)
+		return labels;
+	return py::make_tuple(labels, lines);
+}
+
+PYBIND11_MODULE(pywaterpixels, module)
+{
+	module.doc() = "waterpixels segmentation engine";
+
+	py::class_<PythonSegmenter>(module, "Segmenter")
+		.def(py::init<const std::string &, const bool, const bool>(),
+			py::arg("kernel") = "../clkernel/waterpixels.cl", py::arg("host_watershed") = false, py::arg("block_flooding") = false)
+		.def_property_readonly("flood_seconds", &PythonSegmenter::getFloodSeconds,
+			"seconds taken by the last flooding on the host, to compare block_flooding with the raster order")
+		.def("segment", &PythonSegmenter::segment,
+			py::arg("image"), py::arg("step"), py::arg("weight") = 64.0f, py::arg("rho") = 2.0f / 3.0f, py::arg("contours") = false,
+			py::arg("region") = py::none(),
+			"labels map as a height x width int32 array, cell index + 1 and 0 on the watershed lines, "
+			"with the contours image when asked; both are new arrays owned by the caller. "
+			"With region = (x, y, width, height) only that box is segmented, its labels being those of the whole image");
+}
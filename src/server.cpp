@@ -0,0 +1,470 @@
+#include "server.hpp"
+
+Connection::Connection(const int fd) :
+	fd(fd)
+{
+}
+
+Connection::~Connection()
+{
+	close(fd);
+}
+
+void Connection::reply(const std::string & line)
+{
+	const std::string message{line + "\n"};
+	std::lock_guard<std::mutex> lock(writing);
+	std::size_t sent{0};
+	while(sent < message.size())
+	{
+		// a client gone away must not kill the server with SIGPIPE
+		const ssize_t written = send(fd, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+		if(written <= 0)
+			return;
+		sent += written;
+	}
+}
+
+LatencyHistogram::LatencyHistogram()
+{
+	for(std::atomic<std::uint64_t> & count : counts)
+		count = 0;
+}
+
+void LatencyHistogram::record(const double seconds)
+{
+	int bin{0};
+	while(bin < bins - 1 && seconds * 1000.0 > static_cast<double>(1 << bin))
+		bin++;
+	counts[bin]++;
+}
+
+std::string LatencyHistogram::report() const
+{
+	std::ostringstream words;
+	words << "latency";
+	for(int bin{0}; bin < bins; ++bin)
+	{
+		if(bin < bins - 1)
+			words << " " << (1 << bin) << "ms:" << counts[bin];
+		else
+			words << " inf:" << counts[bin];
+	}
+	return words.str();
+}
+
+SegmentationServer::SegmentationServer(const std::string & kernelFile, const int workers) :
+	kernelFile(kernelFile),
+	workers(std::max(1, workers)),
+	rho(2.0f / 3.0f),
+	queue(queueCapacity),
+	stopping(false),
+	ready(0),
+	broken(0),
+	served(0),
+	failed(0),
+	rejected(0),
+	labelsCount(0)
+{
+}
+
+bool SegmentationServer::run(const std::string & socketPath)
+{
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	if(socketPath.size() >= sizeof(address.sun_path))
+	{
+		std::cerr << "Socket path is too long : " << socketPath << std::endl;
+		return false;
+	}
+	std::copy(socketPath.begin(), socketPath.end(), address.sun_path);
+
+	const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(socketPath.c_str());
+	if(listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(listener, 64) < 0)
+	{
+		std::cerr << "Socket could not be opened : " << socketPath << std::endl;
+		if(listener >= 0)
+			close(listener);
+		return false;
+	}
+
+	// programs are compiled before the first request is accepted
+	std::vector<std::thread> threads;
+	for(int i{0}; i < workers; ++i)
+		threads.emplace_back(&SegmentationServer::work, this);
+	while(ready + broken < workers)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	if(broken > 0)
+	{
+		stopping = true;
+		for(std::thread & thread : threads)
+			thread.join();
+		close(listener);
+		unlink(socketPath.c_str());
+		return false;
+	}
+	std::cout << "Serving on " << socketPath << " with " << workers << " workers." << std::endl;
+
+	// acceptor, reads requests from every client and queues them
+	std::unordered_map<int, std::shared_ptr<Connection>> connections;
+	std::vector<pollfd> polled;
+	char buffer[4096];
+	bool serving{true};
+	while(serving)
+	{
+		polled.assign(1, pollfd{listener, POLLIN, 0});
+		for(const auto & connection : connections)
+			polled.push_back(pollfd{connection.first, POLLIN, 0});
+		if(poll(polled.data(), polled.size(), -1) < 0)
+			continue;
+
+		if(polled[0].revents & POLLIN)
+		{
+			const int client = accept(listener, nullptr, nullptr);
+			if(client >= 0)
+				connections.emplace(client, std::make_shared<Connection>(client));
+		}
+
+		for(std::size_t i{1}; i < polled.size() && serving; ++i)
+		{
+			if(polled[i].revents == 0)
+				continue;
+
+			std::shared_ptr<Connection> connection = connections.at(polled[i].fd);
+			const ssize_t length = recv(connection->fd, buffer, sizeof(buffer), 0);
+			if(length <= 0)
+			{
+				// jobs still running keep the socket open until they reply
+				connections.erase(polled[i].fd);
+				continue;
+			}
+
+			// a client sending no line ending is dropped
+			connection->received.append(buffer, length);
+			if(connection->received.size() > maxLineLength)
+			{
+				connections.erase(polled[i].fd);
+				continue;
+			}
+			std::size_t end;
+			while(serving && (end = connection->received.find('\n')) != std::string::npos)
+			{
+				const std::string line = connection->received.substr(0, end);
+				connection->received.erase(0, end + 1);
+				serving = handleLine(connection, line);
+			}
+		}
+	}
+
+	// queued requests are served before the workers leave
+	stopping = true;
+	for(std::thread & thread : threads)
+		thread.join();
+	connections.clear();
+	close(listener);
+	unlink(socketPath.c_str());
+	return true;
+}
+
+bool SegmentationServer::handleLine(const std::shared_ptr<Connection> & connection, const std::string & line)
+{
+	std::istringstream words(line);
+	std::string command;
+	words >> command;
+
+	if(command == "segment")
+	{
+		SegmentationRequest request;
+		request.connection = connection;
+		request.received = omp_get_wtime();
+		request.sharedInput = false;
+		request.width = 0;
+		request.height = 0;
+		request.step = 0;
+		request.weight = defaultWeight;
+		if(!(words >> request.id >> request.source >> request.step) || request.step <= 0)
+		{
+			connection->reply("error " + (request.id.empty() ? std::string("-") : request.id) + " malformed request");
+			return true;
+		}
+		words >> request.weight;
+
+		// shm:<name>:<width>:<height>
+		if(request.source.compare(0, 4, "shm:") == 0)
+		{
+			std::replace(request.source.begin(), request.source.end(), ':', ' ');
+			std::istringstream shared(request.source.substr(4));
+			if(!(shared >> request.source >> request.width >> request.height) || request.width <= 0 || request.height <= 0)
+			{
+				connection->reply("error " + request.id + " malformed shared memory input");
+				return true;
+			}
+			request.sharedInput = true;
+		}
+
+		// backpressure, the client retries later
+		const std::string id{request.id};
+		if(!queue.tryPush(std::move(request)))
+		{
+			rejected++;
+			connection->reply("busy " + id);
+		}
+	}
+	else if(command == "stats")
+	{
+		std::ostringstream stats;
+		stats << "stats served " << served << " failed " << failed << " rejected " << rejected << " queued " << queue.size() << " " << latency.report();
+		connection->reply(stats.str());
+	}
+	else if(command == "shutdown")
+	{
+		connection->reply("bye");
+		return false;
+	}
+	else if(!command.empty())
+		connection->reply("error - unknown command " + command);
+
+	return true;
+}
+
+void SegmentationServer::work()
+{
+	// kernels can not be shared between threads since their arguments are set before each launch,
+	// so every worker compiles its own program, once
+	bool started{false};
+	try
+	{
+		CLProgram program(kernelFile);
+		Engine engine(program);
+		started = true;
+		ready++;
+
+		std::vector<SegmentationRequest> batch;
+		SegmentationRequest request;
+		while(!stopping || queue.size() > 0)
+		{
+			batch.clear();
+			while(batch.size() < batchSize && queue.tryPop(request))
+				batch.push_back(std::move(request));
+
+			if(batch.empty())
+				std::this_thread::sleep_for(std::chrono::microseconds(idleMicroseconds));
+			else
+				process(engine, batch);
+		}
+	}
+	catch(const std::exception & exception)
+	{
+		// run gives up when a worker can not start
+		std::cerr << "Worker " << (started ? "stopped" : "could not start") << " : " << exception.what() << std::endl;
+		if(!started)
+			broken++;
+	}
+}
+
+bool SegmentationServer::stage(const SegmentationRequest & request, StagedInput & input)
+{
+	input.mapped = nullptr;
+	input.mappedSize = 0;
+	input.data = nullptr;
+
+	if(request.sharedInput)
+	{
+		input.mappedSize = static_cast<std::size_t>(request.width) * request.height * 3;
+		const int fd = shm_open(request.source.c_str(), O_RDONLY, 0);
+		if(fd < 0)
+		{
+			input.error = "shared memory input could not be mapped";
+			return false;
+		}
+
+		// reading past the end of a shorter object raises SIGBUS, which would take the whole server down
+		struct stat status;
+		if(fstat(fd, &status) != 0 || static_cast<std::size_t>(status.st_size) < input.mappedSize)
+		{
+			close(fd);
+			input.error = "shared memory input is smaller than width x height RGB triplets";
+			return false;
+		}
+		input.mapped = mmap(nullptr, input.mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if(input.mapped == MAP_FAILED)
+		{
+			input.mapped = nullptr;
+			input.error = "shared memory input could not be mapped";
+			return false;
+		}
+		input.data = static_cast<const unsigned char*>(input.mapped);
+		input.stride = request.width * 3;
+		return true;
+	}
+
+	input.image = QImage(QString::fromStdString(request.source));
+	if(input.image.isNull())
+	{
+		input.error = "image could not be decoded";
+		return false;
+	}
+	if(input.image.format() != QImage::Format_RGB888)
+		input.image = input.image.convertToFormat(QImage::Format_RGB888);
+	input.data = input.image.constBits();
+	input.stride = input.image.bytesPerLine();
+	return true;
+}
+
+void SegmentationServer::release(StagedInput & input)
+{
+	if(input.mapped != nullptr)
+		munmap(input.mapped, input.mappedSize);
+	input.mapped = nullptr;
+	input.image = QImage();
+}
+
+void SegmentationServer::fail(const SegmentationRequest & request, const std::string & message)
+{
+	failed++;
+	latency.record(omp_get_wtime() - request.received);
+	request.connection->reply("error " + request.id + " " + message);
+}
+
+void SegmentationServer::process(Engine & engine, std::vector<SegmentationRequest> & batch)
+{
+	// sizes first, the pool is reserved once for the largest image so its buffers stay put during the batch
+	std::vector<StagedInput> inputs(batch.size());
+	int largest{-1};
+	for(int i{0}; i < batch.size(); ++i)
+	{
+		SegmentationRequest & request = batch.at(i);
+		if(!request.sharedInput)
+		{
+			const QSize size = QImageReader(QString::fromStdString(request.source)).size();
+			request.width = size.isValid() ? size.width() : 0;
+			request.height = size.isValid() ? size.height() : 0;
+		}
+		if(static_cast<long long>(request.width) * request.height > maxPixels)
+		{
+			request.width = 0;
+			request.height = 0;
+			inputs.at(i).error = "image is too large";
+		}
+		if(largest == -1 || static_cast<long long>(request.width) * request.height > static_cast<long long>(batch.at(largest).width) * batch.at(largest).height)
+			largest = i;
+	}
+
+	unsigned char* smoothRAW[2]{nullptr, nullptr};
+
+	// the smoothing of request i + 1 runs on the staging queue while request i goes through the other stages
+	std::vector<bool> staged(batch.size(), false);
+	cl::Event smoothed[2];
+	auto enqueue = [&](const int i)
+	{
+		const SegmentationRequest & request = batch.at(i);
+		staged[i] = request.width > 0 && stage(request, inputs.at(i));
+		if(staged[i])
+			smoothed[i % 2] = engine.enqueueSmooth(request.width, request.height, request.step, inputs.at(i).data, inputs.at(i).stride, smoothRAW[i % 2]);
+		else if(inputs.at(i).error.empty())
+			inputs.at(i).error = "image size could not be read";
+	};
+
+	std::vector<int> cellIds;
+	int i{0};
+	std::string name;
+	std::size_t size{0};
+	void* labels{MAP_FAILED};
+
+	// the failing request and the ones after it are answered
+	auto failRemaining = [&](const std::string & message)
+	{
+		// a smoothing still in flight reads a staged input, it must complete before the inputs go away
+		engine.getProgram().getStagingQueue().finish();
+		std::cerr << message << std::endl;
+		if(labels != MAP_FAILED)
+		{
+			munmap(labels, size);
+			shm_unlink(name.c_str());
+		}
+		for(; i < batch.size(); ++i)
+			fail(batch.at(i), message);
+	};
+
+	try
+	{
+		BufferPool & pool = engine.getPool();
+		pool.reserve(batch.at(largest).width, batch.at(largest).height);
+		smoothRAW[0] = pool.getHost(HOST_SMOOTH);
+		smoothRAW[1] = pool.getHost(HOST_SMOOTH_NEXT);
+		unsigned char* gradientRAW{pool.getHost(HOST_GRADIENT)};
+		unsigned char* markersRAW{pool.getHost(HOST_MARKERS)};
+		unsigned char* distanceFromMarkersRAW{pool.getHost(HOST_DISTANCE)};
+		unsigned char* regularizedGradientRAW{pool.getHost(HOST_REGULARIZED_GRADIENT)};
+
+		enqueue(0);
+		for(; i < batch.size(); ++i)
+		{
+			if(i + 1 < batch.size())
+				enqueue(i + 1);
+
+			const SegmentationRequest & request = batch.at(i);
+			if(!staged[i])
+			{
+				fail(request, inputs.at(i).error);
+				continue;
+			}
+			smoothed[i % 2].wait();
+			release(inputs.at(i));
+
+			const int w{request.width};
+			const int h{request.height};
+			const HexagonGrid grid(w, h, request.step, rho);
+			if(grid.getCellCount() == 0)
+			{
+				fail(request, "grid step is too small or too large for this image");
+				continue;
+			}
+			cellIds.resize(grid.getCellCount());
+			std::iota(cellIds.begin(), cellIds.end(), 0);
+
+			// labels are flooded straight into the shared memory returned to the client
+			name = "/waterpixels-" + std::to_string(getpid()) + "-" + std::to_string(labelsCount++);
+			size = static_cast<std::size_t>(w) * h * sizeof(int);
+			const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+			struct stat status;
+			if(fd >= 0 && ftruncate(fd, size) == 0 && fstat(fd, &status) == 0 && static_cast<std::size_t>(status.st_size) >= size)
+				labels = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if(fd >= 0)
+				close(fd);
+			if(labels == MAP_FAILED)
+			{
+				shm_unlink(name.c_str());
+				fail(request, "labels shared memory could not be created");
+				continue;
+			}
+
+			engine.computeLabGradient(w, h, smoothRAW[i % 2], gradientRAW);
+			engine.computeCellMarkers(w, h, grid, cellIds, 0, 0, gradientRAW, markersRAW);
+			engine.computeRegularizedGradient(w, h, request.step, request.weight, markersRAW, gradientRAW, distanceFromMarkersRAW, regularizedGradientRAW);
+			engine.computeWatershed(w, h, grid, cellIds, 0, 0, markersRAW, regularizedGradientRAW, static_cast<int*>(labels));
+			munmap(labels, size);
+			labels = MAP_FAILED;
+
+			const double seconds = omp_get_wtime() - request.received;
+			served++;
+			latency.record(seconds);
+			std::ostringstream reply;
+			reply << "ok " << request.id << " " << name << " " << w << " " << h << " " << grid.getCellCount() << " " << seconds;
+			request.connection->reply(reply.str());
+		}
+	}
+	catch(const cl::Error & error)
+	{
+		failRemaining("OpenCL error " + std::to_string(error.err()) + " in " + error.what());
+	}
+	catch(const std::exception & exception)
+	{
+		failRemaining(exception.what());
+	}
+
+	for(StagedInput & input : inputs)
+		release(input);
+}
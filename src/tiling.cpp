@@ -0,0 +1,155 @@
+#include "tiling.hpp"
+
+TiledSegmentation::TiledSegmentation(Engine & engine) :
+	engine(engine),
+	rho(2.0f / 3.0f),
+	weight(64.0f)
+{
+}
+
+QImage TiledSegmentation::decodeTile(const QString & input, const QRect & frame)
+{
+	// one reader per tile, tiles are decoded on a worker thread
+	QImageReader reader(input);
+	reader.setClipRect(frame);
+	QImage tile = reader.read();
+	if(tile.isNull())
+		std::cerr << "Tile could not be decoded : " << reader.errorString().toStdString() << std::endl;
+	else if(tile.format() != QImage::Format_RGB888)
+		tile = tile.convertToFormat(QImage::Format_RGB888);
+	return tile;
+}
+
+bool TiledSegmentation::run(const QString & input, const QString & output, const int step, const int tileSize)
+{
+	QImageReader reader(input);
+	const QSize size = reader.size();
+	if(!size.isValid())
+	{
+		std::cerr << "Image size could not be read : " << input.toStdString() << std::endl;
+		return false;
+	}
+	if(!reader.supportsOption(QImageIOHandler::ClipRect))
+		std::cerr << "Warning : this image format can not be decoded by tile, memory is not bounded by the tile size." << std::endl;
+
+	const int width = size.width();
+	const int height = size.height();
+
+	// grid data, same layout as the one of the GUI
+	const HexagonGrid grid(width, height, step, rho);
+	const int hexWidth = grid.getHexagonWidth();
+	const int baseOffset = grid.getBaseOffset();
+	if(grid.getCellCount() == 0)
+	{
+		std::cerr << "Grid step is too small or too large for this image." << std::endl;
+		return false;
+	}
+
+	// tiles are aligned on the period of the hexagon grid
+	const int periodX = 2 * baseOffset;
+	const int periodY = hexWidth;
+	const int tileWidth = std::max(1, tileSize / periodX) * periodX;
+	const int tileHeight = std::max(1, tileSize / periodY) * periodY;
+	const int halo = Engine::getRegionHalo(step, grid);
+
+	// output labels map
+	QFile file(output);
+	if(!file.open(QIODevice::WriteOnly) || !file.resize(static_cast<qint64>(width) * height * sizeof(int)))
+	{
+		std::cerr << "Labels map could not be written : " << output.toStdString() << std::endl;
+		return false;
+	}
+
+	// tile buffers, sized once for the largest tile and its halo
+	const int maxWidth = std::min(width, tileWidth + 2 * halo);
+	const int maxHeight = std::min(height, tileHeight + 2 * halo);
+	BufferPool & pool = engine.getPool();
+	pool.reserve(maxWidth, maxHeight);
+	unsigned char* smoothRAW[2]{pool.getHost(HOST_SMOOTH), pool.getHost(HOST_SMOOTH_NEXT)};
+	unsigned char* gradientRAW{pool.getHost(HOST_GRADIENT)};
+	unsigned char* markersRAW{pool.getHost(HOST_MARKERS)};
+	unsigned char* distanceFromMarkersRAW{pool.getHost(HOST_DISTANCE)};
+	unsigned char* regularizedGradientRAW{pool.getHost(HOST_REGULARIZED_GRADIENT)};
+	int* labelsMap{pool.getLabels()};
+
+	std::vector<int> cellIds;
+
+	// tiles in row major order
+	const int tilesX = (width + tileWidth - 1) / tileWidth;
+	const int tilesY = (height + tileHeight - 1) / tileHeight;
+	const QRect image(0, 0, width, height);
+	std::vector<QRect> cores;
+	for(int ty{0}; ty < tilesY; ++ty)
+	{
+		for(int tx{0}; tx < tilesX; ++tx)
+			cores.push_back(QRect(tx * tileWidth, ty * tileHeight, tileWidth, tileHeight));
+	}
+	auto frameOf = [&](const int i) -> QRect
+	{
+		return cores.at(i).adjusted(-halo, -halo, halo, halo).intersected(image);
+	};
+
+	// pipeline, tile i + 2 is decoded and tile i + 1 smoothed while tile i goes through the other stages
+	QImage staged[2];
+	cl::Event smoothed[2];
+	std::future<QImage> decoding = std::async(std::launch::async, decodeTile, input, frameOf(0));
+	auto stage = [&](const int i) -> bool
+	{
+		QImage & tile = staged[i % 2];
+		tile = decoding.get();
+		if(tile.isNull())
+			return false;
+
+		const QRect frame = frameOf(i);
+		smoothed[i % 2] = engine.enqueueSmooth(frame.width(), frame.height(), step, tile.constBits(), tile.bytesPerLine(), smoothRAW[i % 2]);
+		if(i + 1 < cores.size())
+			decoding = std::async(std::launch::async, decodeTile, input, frameOf(i + 1));
+		return true;
+	};
+
+	// a smoothing still in flight reads a staged tile, it must complete before leaving
+	auto fail = [&]() -> bool
+	{
+		engine.getProgram().getStagingQueue().finish();
+		return false;
+	};
+
+	if(!stage(0))
+		return fail();
+
+	for(int i{0}; i < cores.size(); ++i)
+	{
+		std::cout << "Tile " << i + 1 << " / " << cores.size() << std::endl;
+
+		if(i + 1 < cores.size() && !stage(i + 1))
+			return fail();
+
+		const QRect frame = frameOf(i);
+		const QRect written = cores.at(i).intersected(image);
+		const int w = frame.width();
+		const int h = frame.height();
+
+		// waterpixels of the tile, its smoothing ran during the previous tile
+		grid.coreCells(frame.left(), frame.top(), frame.right(), frame.bottom(), cellIds);
+		smoothed[i % 2].wait();
+		staged[i % 2] = QImage();
+		engine.computeLabGradient(w, h, smoothRAW[i % 2], gradientRAW);
+		engine.computeCellMarkers(w, h, grid, cellIds, frame.left(), frame.top(), gradientRAW, markersRAW);
+		engine.computeRegularizedGradient(w, h, step, weight, markersRAW, gradientRAW, distanceFromMarkersRAW, regularizedGradientRAW);
+		engine.computeWatershed(w, h, grid, cellIds, frame.left(), frame.top(), markersRAW, regularizedGradientRAW, labelsMap);
+
+		// stitch, only the core of the tile is written
+		for(int y{written.top()}; y <= written.bottom(); ++y)
+		{
+			const int* row = labelsMap + (y - frame.top()) * w + (written.left() - frame.left());
+			file.seek((static_cast<qint64>(y) * width + written.left()) * sizeof(int));
+			if(file.write(reinterpret_cast<const char*>(row), written.width() * sizeof(int)) < 0)
+			{
+				std::cerr << "Labels map could not be written : " << output.toStdString() << std::endl;
+				return fail();
+			}
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,145 @@
+#include "worker.hpp"
+
+PipelineWorker::PipelineWorker(Engine & engine) :
+	QObject(),
+	engine(engine),
+	cancelRequested(false)
+{
+	engine.setCancelFlag(&cancelRequested);
+}
+
+void PipelineWorker::setJob(const PipelineJob & value)
+{
+	job = value;
+	cancelRequested = false;
+}
+
+void PipelineWorker::cancel()
+{
+	cancelRequested = true;
+}
+
+void PipelineWorker::run()
+{
+	const double start = omp_get_wtime();
+
+	// coarse result first, its lines tell where the full resolution flooding can still change labels
+	const int factor{job.preview ? previewFactor() : 1};
+	if(factor > 1 && !runPreview(factor))
+	{
+		emit cancelled();
+		return;
+	}
+
+	// smooth image
+	engine.computeSmooth(job.width, job.height, job.step, job.original, job.originalStride, job.smooth);
+	if(cancelRequested)
+	{
+		emit cancelled();
+		return;
+	}
+	emit stageFinished(STAGE_SMOOTH);
+
+	// compute lab gradient
+	engine.computeLabGradient(job.width, job.height, job.smooth, job.gradient);
+	if(cancelRequested)
+	{
+		emit cancelled();
+		return;
+	}
+	emit stageFinished(STAGE_GRADIENT);
+
+	// compute cell markers
+	engine.computeCellMarkers(job.width, job.height, job.lattice, job.cellIds, 0, 0, job.gradient, job.markers);
+	if(cancelRequested)
+	{
+		emit cancelled();
+		return;
+	}
+	emit stageFinished(STAGE_MARKERS);
+
+	// compute distance from markers and spatial regularization of the gradient
+	engine.computeRegularizedGradient(job.width, job.height, job.step, job.weight, job.markers, job.gradient, job.distance, job.regularizedGradient);
+	if(cancelRequested)
+	{
+		emit cancelled();
+		return;
+	}
+	emit stageFinished(STAGE_REGULARIZATION);
+
+	// watershed, checks for cancellation while flooding;
+	// after a preview only a band as wide as the upsampling error around its lines is flooded
+	if(factor > 1)
+	{
+		upsamplePreview(factor);
+		engine.refineWatershed(job.width, job.height, job.lattice, job.cellIds, 0, 0, job.markers, job.regularizedGradient, 2 * factor, job.labelsMap);
+	}
+	else
+		engine.computeWatershed(job.width, job.height, job.lattice, job.cellIds, 0, 0, job.markers, job.regularizedGradient, job.labelsMap);
+	if(cancelRequested)
+	{
+		emit cancelled();
+		return;
+	}
+	const double end = omp_get_wtime();
+	emit stageFinished(STAGE_WATERSHED);
+
+	const float contourDensity = engine.computeContours(job.width, job.height, job.labelsMap, job.original, job.originalStride, job.contours, job.result);
+	emit stageFinished(STAGE_CONTOURS);
+	emit finished(contourDensity, end - start);
+}
+
+int PipelineWorker::previewFactor() const
+{
+	for(int factor{previewMaxFactor}; factor > 1; factor /= 2)
+	{
+		if(job.step / factor < previewMinStep)
+			continue;
+
+		const HexagonGrid lattice(job.width / factor, job.height / factor, job.step / factor, job.rho);
+		if(lattice.getHexagonWidth() * factor == job.lattice.getHexagonWidth()
+				&& lattice.getBaseOffset() * factor == job.lattice.getBaseOffset()
+				&& lattice.getSlicesX() == job.lattice.getSlicesX()
+				&& lattice.getSlicesY() == job.lattice.getSlicesY())
+			return factor;
+	}
+	return 1;
+}
+
+bool PipelineWorker::runPreview(const int factor)
+{
+	const int width{job.width / factor};
+	const int height{job.height / factor};
+	const int step{job.step / factor};
+	const HexagonGrid lattice(width, height, step, job.rho);
+
+	// the engine buffers are large enough, they are overwritten by the full resolution stages afterwards
+	previewOriginal = QImage(job.original, job.width, job.height, job.originalStride, QImage::Format_RGB888)
+			.scaled(width, height, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+	engine.computeSmooth(width, height, step, previewOriginal.constBits(), previewOriginal.bytesPerLine(), job.smooth);
+	engine.computeLabGradient(width, height, job.smooth, job.gradient);
+	engine.computeCellMarkers(width, height, lattice, job.cellIds, 0, 0, job.gradient, job.markers);
+	engine.computeRegularizedGradient(width, height, step, job.weight, job.markers, job.gradient, job.distance, job.regularizedGradient);
+	engine.computeWatershed(width, height, lattice, job.cellIds, 0, 0, job.markers, job.regularizedGradient, job.labelsMap);
+	if(cancelRequested)
+		return false;
+
+	engine.computeContours(width, height, job.labelsMap, previewOriginal.constBits(), previewOriginal.bytesPerLine(), job.contours, job.result);
+	previewLabels.assign(job.labelsMap, job.labelsMap + width * height);
+	emit previewFinished(QImage(job.result, width, height, width * 3, QImage::Format_RGB888).copy());
+	return true;
+}
+
+void PipelineWorker::upsamplePreview(const int factor)
+{
+	const int width{job.width / factor};
+	const int height{job.height / factor};
+
+	#pragma omp parallel for
+	for(int y = 0; y < job.height; ++y)
+	{
+		const int* row{previewLabels.data() + std::min(y / factor, height - 1) * width};
+		for(int x{0}; x < job.width; ++x)
+			job.labelsMap[y * job.width + x] = row[std::min(x / factor, width - 1)];
+	}
+}
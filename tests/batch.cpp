@@ -0,0 +1,111 @@
+#include <waterpixels.h>
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cstdlib>
+
+// exit code ctest reports as skipped, when no OpenCL device is available
+static constexpr int skipped{77};
+
+/**
+ *	smooth ramps with noise, different for every seed, so two images of a batch never share markers
+ */
+static std::vector<unsigned char> makeImage(const int width, const int height, const unsigned int seed)
+{
+	std::vector<unsigned char> image(width * height * 3);
+	std::minstd_rand random{seed};
+	for(int y{0}; y < height; ++y)
+	{
+		for(int x{0}; x < width; ++x)
+		{
+			for(int c{0}; c < 3; ++c)
+				image[3 * (y * width + x) + c] = static_cast<unsigned char>((x * (c + 1) + y * (seed + c) + random() % 24) & 0xff);
+		}
+	}
+	return image;
+}
+
+int main(int argc, char** argv)
+{
+	if(argc < 2)
+	{
+		std::cerr << "usage : " << argv[0] << " <kernel file>" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	waterpixels_context* context;
+	const waterpixels_status created{waterpixels_create(argv[1], nullptr, &context)};
+	if(created == WATERPIXELS_ERROR_NO_DEVICE)
+		return skipped;
+	if(created != WATERPIXELS_OK)
+	{
+		// a missing kernel file or a failed build is a failure, not a skip
+		std::cerr << "Context could not be created : " << waterpixels_last_error(nullptr) << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	const int width{96};
+	const int height{80};
+	const int count{3};
+	const int pixels{width * height};
+	const waterpixels_params params{sizeof(waterpixels_params), 16, 2.0f / 3.0f, 64.0f, 8};
+
+	// stacked images, the rows of image i following those of image i - 1
+	std::vector<unsigned char> batch;
+	for(int i{0}; i < count; ++i)
+	{
+		const std::vector<unsigned char> image{makeImage(width, height, i + 1)};
+		batch.insert(batch.end(), image.begin(), image.end());
+	}
+
+	int failures{0};
+	for(const int hostWatershed : {0, 1})
+	{
+		const waterpixels_threading threading{sizeof(waterpixels_threading), 0, hostWatershed, 0};
+		waterpixels_set_threading(context, &threading);
+
+		std::vector<int> batchLabels(pixels * count);
+		if(waterpixels_segment_batch(context, batch.data(), width * 3, width, height, count, &params, batchLabels.data()) != WATERPIXELS_OK)
+		{
+			std::cerr << "batch : " << waterpixels_last_error(context) << std::endl;
+			++failures;
+			continue;
+		}
+
+		// every image of the batch, and a batch of only its first image, is labelled as when it is segmented alone
+		std::vector<int> labels(pixels);
+		std::vector<int> single(pixels);
+		if(waterpixels_segment_batch(context, batch.data(), width * 3, width, height, 1, &params, single.data()) != WATERPIXELS_OK)
+		{
+			std::cerr << "batch of one : " << waterpixels_last_error(context) << std::endl;
+			++failures;
+		}
+		for(int i{0}; i < count; ++i)
+		{
+			if(waterpixels_segment(context, batch.data() + i * pixels * 3, width * 3, width, height, &params, labels.data()) != WATERPIXELS_OK)
+			{
+				std::cerr << "image " << i << " : " << waterpixels_last_error(context) << std::endl;
+				++failures;
+				continue;
+			}
+			if(i == 0 && labels != single)
+			{
+				std::cerr << "batch of one" << (hostWatershed ? ", host" : ", device") << " flooding : labels differ from the single image run" << std::endl;
+				++failures;
+			}
+
+			int different{0};
+			for(int p{0}; p < pixels; ++p)
+				different += labels[p] != batchLabels[i * pixels + p];
+			if(different != 0)
+			{
+				std::cerr << "image " << i << (hostWatershed ? ", host" : ", device") << " flooding : "
+					<< different << " labels differ from the single image run" << std::endl;
+				++failures;
+			}
+		}
+	}
+
+	waterpixels_destroy(context);
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}